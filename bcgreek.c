@@ -2,6 +2,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <uchar.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /** Bit masks for modifiers.  Maybe they should all be defined as macros or as
  * constants; in both cases the readability of the declaration suffers.
@@ -26,155 +37,328 @@ static const int breathings = msk_smooth;
 static const int accents = msk_acute;
 static const int lengths = msk_macron;
 
-/** smart_sigma is a global parameter which specifies if word final sigmas
- * should be automatically converted to the final form.
+/** In the interactive mode the output is flushed whenever the input pauses,
+ * and a letter waiting for its modifiers (or, for sigma, for the next
+ * character) is converted after idle_timeout milliseconds of silence.  The
+ * lookahead then returns PAUSE instead of a character.
  */
 
-char smart_sigma = 0;
+#define PAUSE (-2)
+
+int idle_timeout = 500;
+
+/** Output encodings.  Every glyph is stored in each of them: the GLYPH macro
+ * turns a single literal into its UTF-8, UTF-16 and UTF-32 forms at compile
+ * time, so the code units are written directly, never through UTF-8.
+ */
+
+enum encoding { UTF8, UTF16LE, UTF16BE, UTF32LE, UTF32BE, N_ENCODINGS };
+
+char *encoding_names[N_ENCODINGS] = {
+    "utf-8", "utf-16le", "utf-16be", "utf-32le", "utf-32be"
+};
+
+/** The options which affect the conversion of every character form a
+ * `struct config':
+ *
+ *   smart_sigma    convert word final sigmas to the final form
+ *   words          keep track of words, for the case mapping, the
+ *                    dehyphenation and the concordance
+ *   count          count the input bytes in in_pos, for the concordance and
+ *                    the checkpoints
+ *   utf8           the output encoding is UTF-8
+ *   interactive    see above
+ *   encoding       the output encoding
+ *   case_mode      see `Case mapping'
+ *   hyphens        see `Dehyphenation'
+ *   index          build a concordance
+ *   follow         wait for a growing input, see `Checkpoints'
+ *
+ * The conversion functions take it as their last argument.  `convert' and
+ * the `dispatch_' functions, with the input functions they use, are
+ * ENGINE_INLINE: they get inlined into one engine per value of the first
+ * four options, where these are constants and the tests on them disappear.
+ * See `Engines' below.  The output and lookup functions the engines call
+ * are ordinary functions, which the compiler inlines or not; forcing all of
+ * them into every engine made the build take minutes.
+ *
+ * The engines which write UTF-8 do it themselves.  The others call the
+ * writers of their encoding in `unit_outputs', each of them specialized for
+ * it in turn, so the encoding is never tested while converting.
+ *
+ * The other options are tested at run time, but only by the runs which use
+ * an option of their group.  The engines which keep words test case_mode for
+ * every letter, index for every letter and word break, and hyphens for every
+ * `-'; the engines which count compare in_pos with the next checkpoint after
+ * every glyph.  follow is tested at the end of the input only.  interactive
+ * is tested before every character read; as a dimension it would double the
+ * engines and the build time again for one predictable branch next to a
+ * call to getc.  So a plain run pays for that test only, and e.g. -C lower
+ * pays for the word state and the case mapping but doesn't count bytes.
+ */
+
+struct config {
+    char smart_sigma;
+    char words;
+    char count;
+    char utf8;
+    char interactive;
+    enum encoding encoding;
+    char case_mode;
+    char hyphens;
+    char index;
+    char follow;
+};
+
+#define ENGINE_INLINE static inline __attribute__((always_inline))
+
+/** in_pos is the number of bytes read so far, glyph_start the offset of the
+ * character being dispatched.  Only the engines which count keep them.
+ */
+
+uint64_t in_pos = 0;
+uint64_t glyph_start = 0;
+
+/** word_initial tells whether the next letter starts a word.  The line
+ * breaks of a word joined across lines are held until the word ends:
+ * pending_breaks is their number, and bit i of pending_crlf tells whether
+ * the i-th of them is "\r\n" rather than "\n".  Only the engines which
+ * keep words keep them.
+ */
+
+#define MAX_BREAKS 64
+
+int word_initial = 1;
+int pending_breaks = 0;
+uint64_t pending_crlf = 0;
+
+/** The values of hyphens, set by -d and -D; see `dispatch_hyphen'. */
+
+enum { HYPHENS_KEEP, HYPHENS_JOIN, HYPHENS_MARK };
+
+/** The state of the checkpoints; see `Checkpoints' below.  Without -k the
+ * next checkpoint never comes.  checkpoint_out is the output, which the
+ * final checkpoint is taken on from the input functions.
+ */
+
+char *checkpoint_path = NULL;
+FILE *checkpoint_out = NULL;
+uint64_t checkpoint_interval = 64 << 20;
+uint64_t next_checkpoint = UINT64_MAX;
+int resume_char = PAUSE;
+
+char32_t byte_code = 0;
+int byte_more = 0;
+
+struct glyph {
+    char *utf8;
+    char16_t *utf16;
+    char32_t *utf32;
+};
+
+#define GLYPH(x) { x, u ## x, U ## x }
+#define NOGLYPH { NULL, NULL, NULL }
 
 /** The variants of a letter with possible diacritics are stored in arrays.
  * The actual form of the arrays is chosen to facilitate the search.
  */
 
 
-char *alpha_variants[] = {
-    "α", "ἀ", "ἁ",
-    "ά", "ἄ", "ἅ",
-    "ὰ", "ἂ", "ἃ",
-    NULL, NULL, NULL,
-    "ᾶ", "ἆ", "ἇ",
-    "ᾳ", "ᾀ", "ᾁ",
-    "ᾴ", "ᾄ", "ᾅ",
-    "ᾲ", "ᾂ", "ᾃ",
-    NULL, NULL, NULL,
-    "ᾷ", "ᾆ", "ᾇ",
-    "ᾱ", "ᾰ",
-    "Α", "Ἀ", "Ἁ",
-    "Ά", "Ἄ", "Ἅ",
-    "Ὰ", "Ἂ", "Ἃ",
-    NULL, NULL, NULL,
-    "ᾶ", "Ἆ", "Ἇ",
-    "ᾼ", "ᾈ", "ᾉ",
-    "ᾴ", "ᾌ", "ᾍ",
-    "ᾲ", "ᾊ", "ᾋ",
-    NULL, NULL, NULL,
-    "ᾷ", "ᾎ", "ᾏ",
-    "Ᾱ", "Ᾰ"
+struct glyph alpha_variants[] = {
+    GLYPH("α"), GLYPH("ἀ"), GLYPH("ἁ"),
+    GLYPH("ά"), GLYPH("ἄ"), GLYPH("ἅ"),
+    GLYPH("ὰ"), GLYPH("ἂ"), GLYPH("ἃ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ᾶ"), GLYPH("ἆ"), GLYPH("ἇ"),
+    GLYPH("ᾳ"), GLYPH("ᾀ"), GLYPH("ᾁ"),
+    GLYPH("ᾴ"), GLYPH("ᾄ"), GLYPH("ᾅ"),
+    GLYPH("ᾲ"), GLYPH("ᾂ"), GLYPH("ᾃ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ᾷ"), GLYPH("ᾆ"), GLYPH("ᾇ"),
+    GLYPH("ᾱ"), GLYPH("ᾰ"),
+    GLYPH("Α"), GLYPH("Ἀ"), GLYPH("Ἁ"),
+    GLYPH("Ά"), GLYPH("Ἄ"), GLYPH("Ἅ"),
+    GLYPH("Ὰ"), GLYPH("Ἂ"), GLYPH("Ἃ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ᾶ"), GLYPH("Ἆ"), GLYPH("Ἇ"),
+    GLYPH("ᾼ"), GLYPH("ᾈ"), GLYPH("ᾉ"),
+    GLYPH("ᾴ"), GLYPH("ᾌ"), GLYPH("ᾍ"),
+    GLYPH("ᾲ"), GLYPH("ᾊ"), GLYPH("ᾋ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ᾷ"), GLYPH("ᾎ"), GLYPH("ᾏ"),
+    GLYPH("Ᾱ"), GLYPH("Ᾰ")
 };
 
-char *eta_variants[] = {
-    "η", "ἠ", "ἡ",
-    "ή", "ἤ", "ἥ",
-    "ὴ", "ἢ", "ἣ",
-    NULL, NULL, NULL,
-    "ῆ", "ἦ", "ἧ",
-    "ῃ", "ᾐ", "ᾑ",
-    "ῄ", "ᾔ", "ᾕ",
-    "ῂ", "ᾒ", "ᾓ",
-    NULL, NULL, NULL,
-    "ῇ", "ᾖ", "ᾗ",
-    "Η", "Ἠ", "Ἡ",
-    "Ή", "Ἤ", "Ἥ",
-    "Ὴ", "Ἢ", "Ἣ",
-    NULL, NULL, NULL,
-    "ῆ", "Ἦ", "Ἧ",
-    "ῌ", "ᾘ", "ᾙ",
-    "ῄ", "ᾜ", "ᾝ",
-    "ῂ", "ᾚ", "ᾛ",
-    NULL, NULL, NULL,
-    "ῇ", "ᾞ", "ᾟ"
+struct glyph eta_variants[] = {
+    GLYPH("η"), GLYPH("ἠ"), GLYPH("ἡ"),
+    GLYPH("ή"), GLYPH("ἤ"), GLYPH("ἥ"),
+    GLYPH("ὴ"), GLYPH("ἢ"), GLYPH("ἣ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῆ"), GLYPH("ἦ"), GLYPH("ἧ"),
+    GLYPH("ῃ"), GLYPH("ᾐ"), GLYPH("ᾑ"),
+    GLYPH("ῄ"), GLYPH("ᾔ"), GLYPH("ᾕ"),
+    GLYPH("ῂ"), GLYPH("ᾒ"), GLYPH("ᾓ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῇ"), GLYPH("ᾖ"), GLYPH("ᾗ"),
+    GLYPH("Η"), GLYPH("Ἠ"), GLYPH("Ἡ"),
+    GLYPH("Ή"), GLYPH("Ἤ"), GLYPH("Ἥ"),
+    GLYPH("Ὴ"), GLYPH("Ἢ"), GLYPH("Ἣ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῆ"), GLYPH("Ἦ"), GLYPH("Ἧ"),
+    GLYPH("ῌ"), GLYPH("ᾘ"), GLYPH("ᾙ"),
+    GLYPH("ῄ"), GLYPH("ᾜ"), GLYPH("ᾝ"),
+    GLYPH("ῂ"), GLYPH("ᾚ"), GLYPH("ᾛ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῇ"), GLYPH("ᾞ"), GLYPH("ᾟ")
 };
 
-char *omega_variants[] = {
-    "ω", "ὠ", "ὡ",
-    "ώ", "ὤ", "ὥ",
-    "ὼ", "ὢ", "ὣ",
-    NULL, NULL, NULL,
-    "ῶ", "ὦ", "ὧ",
-    "ῳ", "ᾠ", "ᾡ",
-    "ῴ", "ᾤ", "ᾥ",
-    "ῲ", "ᾢ", "ᾣ",
-    NULL, NULL, NULL,
-    "ῷ", "ᾦ", "ᾧ"
-    "Ω", "Ὠ", "Ὡ",
-    "Ώ", "Ὤ", "Ὥ",
-    "Ὼ", "Ὢ", "Ὣ",
-    NULL, NULL, NULL,
-    "ῶ", "Ὦ", "Ὧ",
-    "ῼ", "ᾨ", "ᾩ",
-    "ῴ", "ᾬ", "ᾭ",
-    "ῲ", "ᾪ", "ᾫ",
-    NULL, NULL, NULL,
-    "ῷ", "ᾮ", "ᾯ"
+struct glyph omega_variants[] = {
+    GLYPH("ω"), GLYPH("ὠ"), GLYPH("ὡ"),
+    GLYPH("ώ"), GLYPH("ὤ"), GLYPH("ὥ"),
+    GLYPH("ὼ"), GLYPH("ὢ"), GLYPH("ὣ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῶ"), GLYPH("ὦ"), GLYPH("ὧ"),
+    GLYPH("ῳ"), GLYPH("ᾠ"), GLYPH("ᾡ"),
+    GLYPH("ῴ"), GLYPH("ᾤ"), GLYPH("ᾥ"),
+    GLYPH("ῲ"), GLYPH("ᾢ"), GLYPH("ᾣ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῷ"), GLYPH("ᾦ"), GLYPH("ᾧ"),
+    GLYPH("Ω"), GLYPH("Ὠ"), GLYPH("Ὡ"),
+    GLYPH("Ώ"), GLYPH("Ὤ"), GLYPH("Ὥ"),
+    GLYPH("Ὼ"), GLYPH("Ὢ"), GLYPH("Ὣ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῶ"), GLYPH("Ὦ"), GLYPH("Ὧ"),
+    GLYPH("ῼ"), GLYPH("ᾨ"), GLYPH("ᾩ"),
+    GLYPH("ῴ"), GLYPH("ᾬ"), GLYPH("ᾭ"),
+    GLYPH("ῲ"), GLYPH("ᾪ"), GLYPH("ᾫ"),
+    NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("ῷ"), GLYPH("ᾮ"), GLYPH("ᾯ")
 };
 
-char *iota_variants[] = {
-    "ι", "ί", "ὶ", NULL, "ῖ",
-    "ἰ", "ἴ", "ἲ", NULL, "ἶ",
-    "ἱ", "ἵ", "ἳ", NULL, "ἷ",
-    "ϊ", "ΐ", "ῒ", NULL, "ῗ",
-    "ῑ", "ῐ",
-    "Ι", "Ί", "Ὶ", NULL, "ῖ",
-    "Ἰ", "Ἴ", "Ἲ", NULL, "Ἶ",
-    "Ἱ", "Ἵ", "Ἳ", NULL, "Ἷ",
-    "Ϊ", "ῒ", "ΐ", NULL, "ῗ",
-    "Ῑ", "Ῐ"
+struct glyph iota_variants[] = {
+    GLYPH("ι"), GLYPH("ί"), GLYPH("ὶ"), NOGLYPH, GLYPH("ῖ"),
+    GLYPH("ἰ"), GLYPH("ἴ"), GLYPH("ἲ"), NOGLYPH, GLYPH("ἶ"),
+    GLYPH("ἱ"), GLYPH("ἵ"), GLYPH("ἳ"), NOGLYPH, GLYPH("ἷ"),
+    GLYPH("ϊ"), GLYPH("ΐ"), GLYPH("ῒ"), NOGLYPH, GLYPH("ῗ"),
+    GLYPH("ῑ"), GLYPH("ῐ"),
+    GLYPH("Ι"), GLYPH("Ί"), GLYPH("Ὶ"), NOGLYPH, GLYPH("ῖ"),
+    GLYPH("Ἰ"), GLYPH("Ἴ"), GLYPH("Ἲ"), NOGLYPH, GLYPH("Ἶ"),
+    GLYPH("Ἱ"), GLYPH("Ἵ"), GLYPH("Ἳ"), NOGLYPH, GLYPH("Ἷ"),
+    GLYPH("Ϊ"), GLYPH("ῒ"), GLYPH("ΐ"), NOGLYPH, GLYPH("ῗ"),
+    GLYPH("Ῑ"), GLYPH("Ῐ")
 };
 
-char *upsilon_variants[] = {
-    "υ", "ύ", "ὺ", NULL, "ῦ",
-    "ὐ", "ὔ", "ὒ", NULL, "ὖ",
-    "ὑ", "ὕ", "ὓ", NULL, "ὗ",
-    "ϋ", "ΰ", "ῢ", NULL, "ῧ",
-    "ῡ", "ῠ",
-    "Υ", "Ύ", "Ὺ", NULL, "ῦ",
-    NULL, NULL, NULL, NULL, NULL,
-    "Ὑ", "Ὕ", "Ὓ", NULL, "Ὗ",
-    "Ϋ", "ΰ", "ῢ", NULL, "ῧ",
-    "Ῡ", "Ῠ"
+struct glyph upsilon_variants[] = {
+    GLYPH("υ"), GLYPH("ύ"), GLYPH("ὺ"), NOGLYPH, GLYPH("ῦ"),
+    GLYPH("ὐ"), GLYPH("ὔ"), GLYPH("ὒ"), NOGLYPH, GLYPH("ὖ"),
+    GLYPH("ὑ"), GLYPH("ὕ"), GLYPH("ὓ"), NOGLYPH, GLYPH("ὗ"),
+    GLYPH("ϋ"), GLYPH("ΰ"), GLYPH("ῢ"), NOGLYPH, GLYPH("ῧ"),
+    GLYPH("ῡ"), GLYPH("ῠ"),
+    GLYPH("Υ"), GLYPH("Ύ"), GLYPH("Ὺ"), NOGLYPH, GLYPH("ῦ"),
+    NOGLYPH, NOGLYPH, NOGLYPH, NOGLYPH, NOGLYPH,
+    GLYPH("Ὑ"), GLYPH("Ὕ"), GLYPH("Ὓ"), NOGLYPH, GLYPH("Ὗ"),
+    GLYPH("Ϋ"), GLYPH("ΰ"), GLYPH("ῢ"), NOGLYPH, GLYPH("ῧ"),
+    GLYPH("Ῡ"), GLYPH("Ῠ")
 };
 
-char *epsilon_variants[] = {
-    "ε", "ἐ", "ἑ",
-    "έ", "ἔ", "ἕ",
-    "ὲ", "ἒ", "ἓ",
-    "Ε", "Ἐ", "Ἑ",
-    "Έ", "Ἔ", "Ἕ",
-    "Ὲ", "Ἒ", "Ἓ"
+struct glyph epsilon_variants[] = {
+    GLYPH("ε"), GLYPH("ἐ"), GLYPH("ἑ"),
+    GLYPH("έ"), GLYPH("ἔ"), GLYPH("ἕ"),
+    GLYPH("ὲ"), GLYPH("ἒ"), GLYPH("ἓ"),
+    GLYPH("Ε"), GLYPH("Ἐ"), GLYPH("Ἑ"),
+    GLYPH("Έ"), GLYPH("Ἔ"), GLYPH("Ἕ"),
+    GLYPH("Ὲ"), GLYPH("Ἒ"), GLYPH("Ἓ")
 };
 
-char *omicron_variants[] = {
-    "ο", "ὀ", "ὁ",
-    "ό", "ὄ", "ὅ",
-    "ὸ", "ὂ", "ὃ",
-    "Ο", "Ὀ", "Ὁ",
-    "Ό", "Ὄ", "Ὅ",
-    "Ὸ", "Ὂ", "Ὃ"
+struct glyph omicron_variants[] = {
+    GLYPH("ο"), GLYPH("ὀ"), GLYPH("ὁ"),
+    GLYPH("ό"), GLYPH("ὄ"), GLYPH("ὅ"),
+    GLYPH("ὸ"), GLYPH("ὂ"), GLYPH("ὃ"),
+    GLYPH("Ο"), GLYPH("Ὀ"), GLYPH("Ὁ"),
+    GLYPH("Ό"), GLYPH("Ὄ"), GLYPH("Ὅ"),
+    GLYPH("Ὸ"), GLYPH("Ὂ"), GLYPH("Ὃ")
 };
 
 
 /* Lookup functions */
 
-char* alpha_variant(int mods);
-char* hw_variant(int mods, char *vars[]);
-char* iy_variant(int mods, char *vars[]);
-char* eo_variant(int mods, char *vars[]);
+struct glyph* alpha_variant(int mods);
+struct glyph* hw_variant(int mods, struct glyph vars[]);
+struct glyph* iy_variant(int mods, struct glyph vars[]);
+struct glyph* eo_variant(int mods, struct glyph vars[]);
+
+/* Output functions */
+
+static inline void put_glyph(struct glyph *g, FILE *out, struct config cf);
+ENGINE_INLINE void put_units(struct glyph *g, FILE *out, struct config cf);
+static inline void put_ascii(char *s, FILE *out, struct config cf);
+static inline void put_byte(int c, FILE *out, struct config cf);
+ENGINE_INLINE void decode_byte(int c, FILE *out, struct config cf);
+ENGINE_INLINE void end_bytes(FILE *out, struct config cf);
+ENGINE_INLINE void put_code(char32_t u, FILE *out, struct config cf);
+ENGINE_INLINE void put_unit16(char16_t u, FILE *out, struct config cf);
+ENGINE_INLINE void put_unit32(char32_t u, FILE *out, struct config cf);
+
+struct unit_output {
+    void (*glyph)(struct glyph *g, FILE *out, struct config cf);
+    void (*byte)(int c, FILE *out, struct config cf);
+    void (*end)(FILE *out, struct config cf);
+};
+
+extern struct unit_output unit_outputs[N_ENCODINGS];
+
+/* Case mapping */
+
+ENGINE_INLINE void put_letter(int c, int mods, struct glyph *g, FILE *out,
+        struct config cf);
+void put_cased(int c, int mods, FILE *out, struct config cf);
+struct glyph* case_variant(int c, int mods, int mode);
+struct glyph* small_variant(char c, int mods);
+
+/* Dehyphenation */
+
+int is_letter(int c);
+int joins_line(int c, char *brk);
+static inline int read_line_break(FILE *in, char **brk, struct config cf);
+static inline void finish_hyphen(int c, char *brk, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_hyphen(FILE *in, FILE *out, struct config cf);
+
+/* Concordance */
+
+ENGINE_INLINE void word_letter(int c, int mods, struct config cf);
+ENGINE_INLINE void word_break(FILE *out, struct config cf);
+void put_breaks(FILE *out, struct config cf);
+void index_letter(int c, int mods);
+void index_break(void);
+
+/* Checkpoints */
+
+void checkpoint_write(uint64_t pos, int c, FILE *out, struct config cf);
+int input_end(FILE *in, uint64_t pos, struct config cf);
+int follow_char(FILE *in);
+
+/* Input functions */
+
+int input_ready(FILE *in, int timeout);
+ENGINE_INLINE int next_char(FILE *in, struct config cf);
+ENGINE_INLINE int lookahead(FILE *in, struct config cf);
+ENGINE_INLINE int wait_char(FILE *in, struct config cf);
 
 /* Auxiliary dispatch-related functions */
 
 int mod2bit(int c, int *mask);
-int read_mods(int mask, FILE *stream, int *c);
-int dispatch_a(FILE *in, FILE *out);
-int dispatch_e(FILE *in, FILE *out);
-int dispatch_o(FILE *in, FILE *out);
-int dispatch_i(FILE *in, FILE *out);
-int dispatch_u(FILE *in, FILE *out);
-int dispatch_h(FILE *in, FILE *out);
-int dispatch_w(FILE *in, FILE *out);
-int dispatch_r(FILE *in, FILE *out);
-int dispatch_s(FILE *in, FILE *out);
-char* capital_variant(char c, int mods);
-int dispatch_capital(FILE *in, FILE *out);
+ENGINE_INLINE int read_mods(int mask, FILE *stream, int *c, struct config cf);
+ENGINE_INLINE int dispatch_a(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_e(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_o(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_i(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_u(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_h(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_w(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_r(FILE *in, FILE *out, struct config cf);
+ENGINE_INLINE int dispatch_s(FILE *in, FILE *out, struct config cf);
+struct glyph* capital_variant(char c, int mods);
+ENGINE_INLINE int dispatch_capital(FILE *in, FILE *out, struct config cf);
 
 
 /** The program consequently reads characters from one stream, processes them,
@@ -182,7 +366,7 @@ int dispatch_capital(FILE *in, FILE *out);
  * function.  It takes a character as an argument and is supposed to write
  * something to a given output stream.  However, it may also need to read a few
  * more characters to determine what to output.  So the function takes three
- * arguments.
+ * arguments, plus the configuration.
  *
  * dispatch_char returns a char to be processed next.
  *
@@ -194,93 +378,195 @@ int dispatch_capital(FILE *in, FILE *out);
  *
  */
 
-#define CASE_FPUTS_GETC(x, y) case x: fputs(y, out); return getc(in);
+#define PUT_GLYPH(x, out, cf) \
+    do { static struct glyph g_ = GLYPH(x); put_glyph(&g_, out, cf); } while (0)
+
+#define PUT_LETTER(c, mods, x, out, cf) \
+    do { \
+        static struct glyph g_ = GLYPH(x); \
+        put_letter(c, mods, &g_, out, cf); \
+    } while (0)
 
-int dispatch_char(char c, FILE *in, FILE *out)
+#define CASE_PUT_GETC(x, y) \
+    case x: \
+        PUT_LETTER(x, 0, y, out, cf); \
+        break;
+
+#define CASE_PUT_BREAK(x, y) \
+    case x: \
+        word_break(out, cf); \
+        PUT_GLYPH(y, out, cf); \
+        break;
+
+ENGINE_INLINE int dispatch_char(char c, FILE *in, FILE *out, struct config cf)
 {
+    if (cf.count) glyph_start = in_pos - 1;
     switch(c) {
-        CASE_FPUTS_GETC('b', "β")
-        CASE_FPUTS_GETC('c', "ξ")
-        CASE_FPUTS_GETC('d', "δ")
-        CASE_FPUTS_GETC('f', "φ")
-        CASE_FPUTS_GETC('g', "γ")
-        CASE_FPUTS_GETC('j', "ς")
-        CASE_FPUTS_GETC('k', "κ")
-        CASE_FPUTS_GETC('l', "λ")
-        CASE_FPUTS_GETC('m', "μ")
-        CASE_FPUTS_GETC('n', "ν")
-        CASE_FPUTS_GETC('p', "π")
-        CASE_FPUTS_GETC('q', "θ")
-        CASE_FPUTS_GETC('t', "τ")
-        CASE_FPUTS_GETC('v', "ϝ")
-        CASE_FPUTS_GETC('x', "χ")
-        CASE_FPUTS_GETC('y', "ψ")
-        CASE_FPUTS_GETC('z', "ζ")
-        CASE_FPUTS_GETC('B', "β")
-        CASE_FPUTS_GETC('C', "ξ")
-        CASE_FPUTS_GETC('D', "δ")
-        CASE_FPUTS_GETC('F', "φ")
-        CASE_FPUTS_GETC('G', "γ")
-        CASE_FPUTS_GETC('J', "ς")
-        CASE_FPUTS_GETC('K', "κ")
-        CASE_FPUTS_GETC('L', "λ")
-        CASE_FPUTS_GETC('M', "μ")
-        CASE_FPUTS_GETC('N', "ν")
-        CASE_FPUTS_GETC('P', "π")
-        CASE_FPUTS_GETC('Q', "θ")
-        CASE_FPUTS_GETC('T', "τ")
-        CASE_FPUTS_GETC('V', "ϝ")
-        CASE_FPUTS_GETC('X', "χ")
-        CASE_FPUTS_GETC('Y', "ψ")
-        CASE_FPUTS_GETC('Z', "ζ")
-        CASE_FPUTS_GETC('\'', "'")
-        CASE_FPUTS_GETC(':', "·")
+        CASE_PUT_GETC('b', "β")
+        CASE_PUT_GETC('c', "ξ")
+        CASE_PUT_GETC('d', "δ")
+        CASE_PUT_GETC('f', "φ")
+        CASE_PUT_GETC('g', "γ")
+        CASE_PUT_GETC('j', "ς")
+        CASE_PUT_GETC('k', "κ")
+        CASE_PUT_GETC('l', "λ")
+        CASE_PUT_GETC('m', "μ")
+        CASE_PUT_GETC('n', "ν")
+        CASE_PUT_GETC('p', "π")
+        CASE_PUT_GETC('q', "θ")
+        CASE_PUT_GETC('t', "τ")
+        CASE_PUT_GETC('v', "ϝ")
+        CASE_PUT_GETC('x', "χ")
+        CASE_PUT_GETC('y', "ψ")
+        CASE_PUT_GETC('z', "ζ")
+        CASE_PUT_GETC('B', "β")
+        CASE_PUT_GETC('C', "ξ")
+        CASE_PUT_GETC('D', "δ")
+        CASE_PUT_GETC('F', "φ")
+        CASE_PUT_GETC('G', "γ")
+        CASE_PUT_GETC('J', "ς")
+        CASE_PUT_GETC('K', "κ")
+        CASE_PUT_GETC('L', "λ")
+        CASE_PUT_GETC('M', "μ")
+        CASE_PUT_GETC('N', "ν")
+        CASE_PUT_GETC('P', "π")
+        CASE_PUT_GETC('Q', "θ")
+        CASE_PUT_GETC('T', "τ")
+        CASE_PUT_GETC('V', "ϝ")
+        CASE_PUT_GETC('X', "χ")
+        CASE_PUT_GETC('Y', "ψ")
+        CASE_PUT_GETC('Z', "ζ")
+        CASE_PUT_BREAK('\'', "'")
+        CASE_PUT_BREAK(':', "·")
         case 'a':
         case 'A':
-            return dispatch_a(in, out);
+            return dispatch_a(in, out, cf);
         case 'e':
         case 'E':
-            return dispatch_e(in, out);
+            return dispatch_e(in, out, cf);
         case 'h':
         case 'H':
-            return dispatch_h(in, out);
+            return dispatch_h(in, out, cf);
         case 'i':
         case 'I':
-            return dispatch_i(in, out);
+            return dispatch_i(in, out, cf);
         case 'o':
         case 'O':
-            return dispatch_o (in, out);
+            return dispatch_o(in, out, cf);
         case 'r':
         case 'R':
-            return dispatch_r (in, out);
+            return dispatch_r(in, out, cf);
         case 's':
         case 'S':
-            return dispatch_s (in, out);
+            return dispatch_s(in, out, cf);
         case 'u':
         case 'U':
-            return dispatch_u(in, out);
+            return dispatch_u(in, out, cf);
         case 'w':
         case 'W':
-            return dispatch_w(in, out);
+            return dispatch_w(in, out, cf);
         case '*':
-            return dispatch_capital(in, out);
+            return dispatch_capital(in, out, cf);
+        case '-':
+            if (cf.words && cf.hyphens) return dispatch_hyphen(in, out, cf);
+            // fall through
         default:
-            putc(c, out);
-            return getc(in);
+            word_break(out, cf);
+            put_byte(c, out, cf);
     }
+    // The glyph is complete, the next one starts with the next character.
+    return next_char(in, cf);
 }
 
 /** The function `convert' processes the input stream in a loop by constanly
- * evoking `dispatch_char' and feeding its output to the next invocation.
+ * evoking `dispatch_char' and feeding its output to the next invocation.  A
+ * PAUSE only means that the previous letter has been written out, so we
+ * simply wait for the next character.
+ *
+ * Between two invocations the only state of the dispatcher is the character
+ * it has read ahead, which makes it the place to take checkpoints.  When
+ * resuming, that character comes from the checkpoint.
  */
 
-void convert(FILE *in, FILE *out)
+ENGINE_INLINE void convert(FILE *in, FILE *out, struct config cf)
 {
-    int c = getc(in);
+    int c = cf.count ? resume_char : PAUSE;
+
+    if (c == PAUSE) c = next_char(in, cf);
     while (c != EOF) {
-        c = dispatch_char(c, in, out);
+        c = dispatch_char(c, in, out, cf);
+        if (c == PAUSE) c = next_char(in, cf);
+        if (cf.count && in_pos >= next_checkpoint) {
+            checkpoint_write(in_pos, c, out, cf);
+        }
+    }
+    word_break(out, cf);
+    if (!cf.utf8) unit_outputs[cf.encoding].end(out, cf);
+
+}
+
+/** Input.  `next_char' reads the first character of the next glyph, while
+ * `lookahead' reads a character which may still belong to the current one,
+ * and `wait_char' one which must belong to it.  In the batch mode all three
+ * are plain getc.  In the interactive mode, before blocking on the input, we
+ * flush whatever has been converted so far; and `lookahead' gives up after
+ * idle_timeout milliseconds.
+ *
+ * `input_ready' polls the underlying descriptor, so the interactive mode
+ * relies on the input stream being unbuffered.  Streams without a descriptor
+ * (-x) are always ready.
+ *
+ * When following a growing file, the end of file only means that we have to
+ * wait for more; see `follow_char'.  When taking checkpoints, the final one
+ * is taken as soon as the input ends, where the glyph being read began; see
+ * `input_end'.
+ */
+
+int input_ready(FILE *in, int timeout)
+{
+    struct pollfd p;
+
+    p.fd = fileno(in);
+    p.events = POLLIN;
+    if (p.fd < 0) return 1;
+    // On error, let getc find it out.
+    return poll(&p, 1, timeout) != 0;
+}
+
+ENGINE_INLINE int next_char(FILE *in, struct config cf)
+{
+    int c;
+
+    if (cf.interactive && !input_ready(in, 0)) fflush(NULL);
+    c = getc(in);
+    if (c == EOF && (cf.count || cf.follow)) c = input_end(in, in_pos, cf);
+    if (cf.count && c != EOF) in_pos++;
+    return c;
+}
+
+ENGINE_INLINE int lookahead(FILE *in, struct config cf)
+{
+    int c;
+
+    if (cf.interactive && !input_ready(in, 0)) {
+        fflush(NULL);
+        if (!input_ready(in, idle_timeout)) return PAUSE;
     }
+    c = getc(in);
+    if (c == EOF && (cf.count || cf.follow)) c = input_end(in, glyph_start, cf);
+    if (cf.count && c != EOF) in_pos++;
+    return c;
+}
 
+ENGINE_INLINE int wait_char(FILE *in, struct config cf)
+{
+    int c;
+
+    if (cf.interactive && !input_ready(in, 0)) fflush(NULL);
+    c = getc(in);
+    if (c == EOF && (cf.count || cf.follow)) c = input_end(in, glyph_start, cf);
+    if (cf.count && c != EOF) in_pos++;
+    return c;
 }
 
 
@@ -300,7 +586,7 @@ void convert(FILE *in, FILE *out)
  * takes a mask of admissible modifiers and *modifies it*.
  */
 
-// EOF -> 0, all right
+// EOF, PAUSE -> 0, all right
 int mod2bit(int c, int *mask)
 {
     int res;
@@ -355,11 +641,11 @@ int mod2bit(int c, int *mask)
  *
  */
 
-int read_mods(int mask, FILE *stream, int *c)
+ENGINE_INLINE int read_mods(int mask, FILE *stream, int *c, struct config cf)
 {
     int mods = 0;
     int mod = 0;
-    while ((mod = mod2bit(*c = getc(stream), &mask))) {
+    while ((mod = mod2bit(*c = lookahead(stream, cf), &mask))) {
         mods |= mod;
     }
     return mods;
@@ -375,96 +661,109 @@ int read_mods(int mask, FILE *stream, int *c)
  *
  * The case of sigma is also treated differently.  It doesn't accept modifiers,
  * but can be changed to the final sigma.
+ *
+ * Every letter goes through `put_letter', which takes care of the case
+ * mapping and of the concordance.
  */
 
 
-int dispatch_a(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_a(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(alpha_variant(read_mods(~msk_diaeresis, in, &c)), out);
+    int mods = read_mods(~msk_diaeresis, in, &c, cf);
+    put_letter('a', mods, alpha_variant(mods), out, cf);
     return c;
 }
 
-int dispatch_e(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_e(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(eo_variant(read_mods((~msk_iota)
-                    & (~msk_diaeresis)
-                    & msk_no_lengths,
-                    in, &c), epsilon_variants), out);
+    int mods = read_mods((~msk_iota)
+            & (~msk_diaeresis)
+            & msk_no_lengths,
+            in, &c, cf);
+    put_letter('e', mods, eo_variant(mods, epsilon_variants), out, cf);
     return c;
 }
 
-int dispatch_o(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_o(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(eo_variant(read_mods((~msk_iota)
-                    & (~msk_diaeresis)
-                    & msk_no_lengths,
-                    in, &c), omicron_variants), out);
+    int mods = read_mods((~msk_iota)
+            & (~msk_diaeresis)
+            & msk_no_lengths,
+            in, &c, cf);
+    put_letter('o', mods, eo_variant(mods, omicron_variants), out, cf);
     return c;
 }
 
-int dispatch_i(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_i(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(iy_variant(read_mods(~msk_iota, in, &c), iota_variants), out);
+    int mods = read_mods(~msk_iota, in, &c, cf);
+    put_letter('i', mods, iy_variant(mods, iota_variants), out, cf);
     return c;
 }
 
-int dispatch_u(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_u(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(iy_variant(read_mods(~msk_iota, in, &c), upsilon_variants), out);
+    int mods = read_mods(~msk_iota, in, &c, cf);
+    put_letter('u', mods, iy_variant(mods, upsilon_variants), out, cf);
     return c;
 }
 
-int dispatch_h(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_h(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(hw_variant(read_mods((~msk_diaeresis) & msk_no_lengths, in, &c),
-                eta_variants), out);
+    int mods = read_mods((~msk_diaeresis) & msk_no_lengths, in, &c, cf);
+    put_letter('h', mods, hw_variant(mods, eta_variants), out, cf);
     return c;
 }
 
-int dispatch_w(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_w(FILE *in, FILE *out, struct config cf)
 {
     int c;
-    fputs(hw_variant(read_mods((~msk_diaeresis) & msk_no_lengths, in, &c),
-                omega_variants), out);
+    int mods = read_mods((~msk_diaeresis) & msk_no_lengths, in, &c, cf);
+    put_letter('w', mods, hw_variant(mods, omega_variants), out, cf);
     return c;
 }
 
-int dispatch_r(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_r(FILE *in, FILE *out, struct config cf)
 {
-    int c = getc(in);
+    int c = lookahead(in, cf);
     switch (c) {
         case '(':
-            fputs("ῥ", out);
-            return getc(in);
+            PUT_LETTER('r', msk_rough, "ῥ", out, cf);
+            return next_char(in, cf);
         case ')':
-            fputs("ῤ", out);
-            return getc(in);
+            PUT_LETTER('r', msk_smooth, "ῤ", out, cf);
+            return next_char(in, cf);
         default:
-            fputs("ρ", out);
+            PUT_LETTER('r', 0, "ρ", out, cf);
             return c;
     }
 }
 
-int dispatch_s(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_s(FILE *in, FILE *out, struct config cf)
 {
-    if (smart_sigma) {
-        int c = getc(in);
-        if (((('a' <= c) && (c <= 'z')))
-                || (('A' <= c) && (c <= 'Z'))) {
-            fputs("σ", out);
+    if (cf.smart_sigma) {
+        int c = lookahead(in, cf);
+        char *brk = NULL;
+        // A hyphen at the end of the line may still continue the word.
+        if (cf.words && cf.hyphens && c == '-') {
+            c = read_line_break(in, &brk, cf);
+        }
+        if (brk ? joins_line(c, brk) : is_letter(c)) {
+            PUT_LETTER('s', 0, "σ", out, cf);
         } else {
-            fputs("ς", out);
+            PUT_LETTER('j', 0, "ς", out, cf);
         }
+        if (brk) finish_hyphen(c, brk, out, cf);
         return c;
     } else {
-        fputs("σ", out);
-        return getc(in);
+        PUT_LETTER('s', 0, "σ", out, cf);
+        return next_char(in, cf);
     }
 }
 
@@ -475,9 +774,10 @@ int dispatch_s(FILE *in, FILE *out)
  */
 
 
-#define CASE_RETURN(x, y) case x: return y;
+#define CASE_RETURN(x, y) \
+    case x: { static struct glyph g_ = GLYPH(y); return &g_; }
 
-char* capital_variant(char c, int mods)
+struct glyph* capital_variant(char c, int mods)
 {
     if (mods == msk_capital) {
         switch(c) {
@@ -605,14 +905,15 @@ char* capital_variant(char c, int mods)
             case 'O':
                 if ( !(mods & (msk_iota | msk_diaeresis
                                 | msk_macron | msk_breve | msk_circumflex))) {
-                    return eo_variant(mods, omega_variants);
+                    return eo_variant(mods, omicron_variants);
                 } else {
                     return NULL;
                 }
             case 'r':
             case 'R':
                 if ((mods == (msk_capital | msk_rough))) {
-                    return "Ῥ";
+                    static struct glyph g = GLYPH("Ῥ");
+                    return &g;
                 } else {
                     return NULL;
                 }
@@ -636,10 +937,13 @@ char* capital_variant(char c, int mods)
  *
  * dispatch_capital uses a mask in the same way as read_mods.  It also uses a
  * buffer to store the asterisk and the modifiers in case the characters can't
- * be converted into a valid Greek letter.
+ * be converted into a valid Greek letter.  Until the letter comes there is
+ * nothing to convert, so in the interactive mode the characters after the
+ * asterisk are read with `wait_char', which waits for them, rather than with
+ * `lookahead', which would give up after idle_timeout.
  */
 
-int dispatch_capital(FILE *in, FILE *out)
+ENGINE_INLINE int dispatch_capital(FILE *in, FILE *out, struct config cf)
 {
     char buf[5];
     buf[0] = '*';
@@ -653,21 +957,22 @@ int dispatch_capital(FILE *in, FILE *out)
     int mods = msk_capital;
     int mod;
 
-    char* s;
+    struct glyph* s;
 
     // loop: read a char
     // assign it to c and to buf[++i]
     // calculate the bit form of the modifier
     // if it's zero, break
-    while ((mod = mod2bit( (buf[++i] = (c = getc(in))), &mask))) {
+    while ((mod = mod2bit( (buf[++i] = (c = wait_char(in, cf))), &mask))) {
         mods |= mod;
     }
     if ((s = capital_variant(c, mods))) {
-            fputs(s, out);
-            return getc(in);
+            put_letter(c, mods, s, out, cf);
+            return next_char(in, cf);
         } else {
             buf[i] = '\0';
-            fputs(buf, out);
+            word_break(out, cf);
+            put_ascii(buf, out, cf);
             return c;
         }
 
@@ -677,10 +982,10 @@ int dispatch_capital(FILE *in, FILE *out)
  * of modifiers is checked elsewhere.
  */
 
-char* alpha_variant(int mods)
+struct glyph* alpha_variant(int mods)
 {
 
-    return alpha_variants[
+    return &alpha_variants[
         mods / breathings % 4 // breathing
         + mods / accents % 8 * 3 // + 3*accent
         + mods / msk_iota % 2 * 15 // + 15*iota
@@ -690,10 +995,10 @@ char* alpha_variant(int mods)
         ];
 }
 
-char* hw_variant(int mods, char *vars[])
+struct glyph* hw_variant(int mods, struct glyph vars[])
 {
 
-    return vars[
+    return &vars[
         mods / breathings % 4 // breathing
         + mods / accents % 8 * 3 // + 3*accent
         + mods / msk_iota % 2 * 15 // + 15*iota
@@ -701,9 +1006,9 @@ char* hw_variant(int mods, char *vars[])
         ];
 }
 
-char* iy_variant(int mods, char *vars[])
+struct glyph* iy_variant(int mods, struct glyph vars[])
 {
-    return vars[
+    return &vars[
         mods / accents % 8 // accent
         + (mods / breathings % 4 + mods / msk_diaeresis %2 * 3) * 5 // + 6* breathing, diaeresis = breathing #3
         + mods / msk_macron % 2 * 20 // + 20*macron
@@ -712,112 +1017,1776 @@ char* iy_variant(int mods, char *vars[])
         ];
 }
 
-char* eo_variant(int mods, char *vars[])
+struct glyph* eo_variant(int mods, struct glyph vars[])
 {
-    return vars[ mods / breathings % 4 // breathing
+    return &vars[ mods / breathings % 4 // breathing
         + (mods / accents % 4) * 3 // + 3*accent
         + mods / msk_capital % 2 * 9 // + 9*capital
         ];
 }
 
 
-/*
- *                      User interface
+/** Output.  In UTF-8 glyphs and other characters are written as they are.  In
+ * the other encodings `put_glyph' writes the precomputed code units, while
+ * the characters copied from the input, which is supposed to be UTF-8, are
+ * decoded by `put_byte' one byte at a time, the unfinished code point being
+ * kept in byte_code and byte_more.  Malformed sequences become U+FFFD.
+ *
+ * `put_glyph' and `put_byte' only handle UTF-8 themselves, so that they stay
+ * small enough to be inlined into the engines.  The other encodings are done
+ * by `put_units' and `decode_byte', which, with the functions they call, are
+ * ENGINE_INLINE: UNIT_OUTPUT specializes them for each encoding the way
+ * ENGINE specializes `convert'.  The engines which don't write UTF-8 call
+ * them through `unit_outputs'.
  */
 
-void usage(FILE *out)
+static inline void put_glyph(struct glyph *g, FILE *out, struct config cf)
 {
-    fprintf(out, "usage: bcgreek [-s] [-f input_file] [-x string] [-o output_file]\n");
-    fprintf(out, "Convert beta code into polytonic Greek.\n");
-    fprintf(out, "  -s                    automatically convert S into final sigma\n");
-    fprintf(out, "  -f input_file         input file; if this option is missing, standard input\n");
-    fprintf(out, "                          is used\n");
-    fprintf(out, "  -x string             process string\n");
-    fprintf(out, "  -o output_file        output file; if this option is missing, standard\n");
-    fprintf(out, "                          output is used\n");
-    fprintf(out, "  -h                    display this help and exit\n");
+    if (cf.utf8) {
+        fputs(g->utf8, out);
+    } else {
+        unit_outputs[cf.encoding].glyph(g, out, cf);
+    }
 }
 
-int main(int argc, char *argv[])
+ENGINE_INLINE void put_units(struct glyph *g, FILE *out, struct config cf)
 {
-    FILE *in;
-    FILE *out;
-    int oc;
+    char16_t *u;
+    char32_t *v;
 
-    int sflag = 0;
-    int fflag = 0;
-    int oflag = 0;
-    int xflag = 0;
-    char *fvalue;
-    char *ovalue;
-    char *xvalue;
+    end_bytes(out, cf);
+    if (cf.encoding == UTF16LE || cf.encoding == UTF16BE) {
+        for (u = g->utf16; *u; u++) put_unit16(*u, out, cf);
+    } else {
+        for (v = g->utf32; *v; v++) put_unit32(*v, out, cf);
+    }
+}
 
-    while ((oc = getopt(argc, argv, "sf:o:hx:")) != -1) {
-        switch (oc) {
-            case 's':
-                sflag = 1;
-                break;
-            case 'f':
-                fflag = 1;
-                fvalue = optarg;
-                break;
-            case 'o':
-                oflag = 1;
-                ovalue = optarg;
-                break;
-            case 'x':
-                xflag = 1;
-                xvalue = optarg;
-                break;
-            case 'h':
-                usage(stdout);
-                exit(0);
-            default:
-                usage(stderr);
-                exit(1);
-            }
+static inline void put_ascii(char *s, FILE *out, struct config cf)
+{
+    while (*s) put_byte(*s++, out, cf);
+}
+
+static inline void put_byte(int c, FILE *out, struct config cf)
+{
+    if (cf.utf8) {
+        putc(c, out);
+    } else {
+        unit_outputs[cf.encoding].byte(c, out, cf);
     }
+}
 
-    if (optind < argc) {
-        usage(stderr);
-        exit(1);
+ENGINE_INLINE void decode_byte(int c, FILE *out, struct config cf)
+{
+    // dispatch_char gets a char, which may be signed.
+    c = (unsigned char) c;
+    if (c < 0x80) {
+        end_bytes(out, cf);
+        put_code(c, out, cf);
+    } else if (c < 0xc0) {
+        if (byte_more) {
+            byte_code = (byte_code << 6) | (c & 0x3f);
+            if (!--byte_more) put_code(byte_code, out, cf);
+        } else {
+            put_code(0xfffd, out, cf);
+        }
+    } else {
+        end_bytes(out, cf);
+        if (c < 0xe0) {
+            byte_code = c & 0x1f;
+            byte_more = 1;
+        } else if (c < 0xf0) {
+            byte_code = c & 0x0f;
+            byte_more = 2;
+        } else if (c < 0xf8) {
+            byte_code = c & 0x07;
+            byte_more = 3;
+        } else {
+            put_code(0xfffd, out, cf);
+        }
     }
+}
 
-    if (sflag) smart_sigma = 1;
+/** `end_bytes' reports an unfinished sequence, if there is one, before
+ * something else is written.  `put_code' writes a complete code point.  The
+ * code units are written with putc_unlocked: there is a single thread, and
+ * locking the stream for every byte cost more than the rest of the writers.
+ */
 
-    // Input from stdin, from a file, or from a string.
-    
-    in = stdin;
+ENGINE_INLINE void end_bytes(FILE *out, struct config cf)
+{
+    if (byte_more) {
+        byte_more = 0;
+        put_code(0xfffd, out, cf);
+    }
+}
 
-    // Before any stream is open, make sure fflag and xflag are not set
-    // simultaneously.
-    if (fflag) {
-        if (xflag) {
-            fprintf(stderr, "%s: You can't use the -x and -f options simultaneously.\n", argv[0]);
-            exit(1);
-        }
-        in = fopen(fvalue, "r");
-        if (!in) {
-            fprintf(stderr, "Cannot read from file %s.\n", fvalue);
-            exit(1);
+ENGINE_INLINE void put_code(char32_t u, FILE *out, struct config cf)
+{
+    if (u > 0x10ffff || (0xd800 <= u && u < 0xe000)) u = 0xfffd;
+    if (cf.encoding == UTF16LE || cf.encoding == UTF16BE) {
+        if (u > 0xffff) {
+            put_unit16(0xd800 + ((u - 0x10000) >> 10), out, cf);
+            put_unit16(0xdc00 + (u & 0x3ff), out, cf);
+        } else {
+            put_unit16(u, out, cf);
         }
+    } else {
+        put_unit32(u, out, cf);
     }
+}
 
-    if (xflag) in = fmemopen(xvalue, strlen(xvalue), "r");
+ENGINE_INLINE void put_unit16(char16_t u, FILE *out, struct config cf)
+{
+    if (cf.encoding == UTF16LE) {
+        putc_unlocked(u & 0xff, out);
+        putc_unlocked(u >> 8, out);
+    } else {
+        putc_unlocked(u >> 8, out);
+        putc_unlocked(u & 0xff, out);
+    }
+}
 
-    if (oflag) {
-        out = fopen(ovalue, "w");
-        if (!out) {
-            fprintf(stderr, "Cannot write to file %s.\n", ovalue);
-            exit(1);
-        }
+ENGINE_INLINE void put_unit32(char32_t u, FILE *out, struct config cf)
+{
+    if (cf.encoding == UTF32LE) {
+        putc_unlocked(u & 0xff, out);
+        putc_unlocked((u >> 8) & 0xff, out);
+        putc_unlocked((u >> 16) & 0xff, out);
+        putc_unlocked(u >> 24, out);
     } else {
-        out = stdout;
+        putc_unlocked(u >> 24, out);
+        putc_unlocked((u >> 16) & 0xff, out);
+        putc_unlocked((u >> 8) & 0xff, out);
+        putc_unlocked(u & 0xff, out);
+    }
+}
+
+/** The writers of one encoding. */
+
+#define UNIT_OUTPUT(name, enc) \
+    void put_units_ ## name(struct glyph *g, FILE *out, struct config cf) \
+    { \
+        cf.encoding = enc; \
+        put_units(g, out, cf); \
+    } \
+    void decode_byte_ ## name(int c, FILE *out, struct config cf) \
+    { \
+        cf.encoding = enc; \
+        decode_byte(c, out, cf); \
+    } \
+    void end_bytes_ ## name(FILE *out, struct config cf) \
+    { \
+        cf.encoding = enc; \
+        end_bytes(out, cf); \
+    }
+
+#define UNIT_OUTPUT_NAMES(name) \
+    { put_units_ ## name, decode_byte_ ## name, end_bytes_ ## name }
+
+UNIT_OUTPUT(utf16le, UTF16LE)
+UNIT_OUTPUT(utf16be, UTF16BE)
+UNIT_OUTPUT(utf32le, UTF32LE)
+UNIT_OUTPUT(utf32be, UTF32BE)
+
+struct unit_output unit_outputs[N_ENCODINGS] = {
+    { NULL, NULL, NULL },       // UTF-8 is written by the engines
+    UNIT_OUTPUT_NAMES(utf16le),
+    UNIT_OUTPUT_NAMES(utf16be),
+    UNIT_OUTPUT_NAMES(utf32le),
+    UNIT_OUTPUT_NAMES(utf32be)
+};
+
+
+/*
+ *                      Case mapping
+ */
+
+/** With -C the letters are put into upper case without diacritics, into
+ * lower case, or into title case (the first letter of every word capital,
+ * the rest small).  A case mode is a pair of `case_map's, one for the first
+ * letter of a word and one for the others, and it is applied to the modifier
+ * bitmask before the lookup: the bits in `clear' are dropped and those in
+ * `set' added.  Thus uppercasing sets msk_capital and drops the accents,
+ * the breathings and the lengths, as the Greek uppercasing rules require;
+ * the diaeresis stays.  An iota subscript becomes a capital iota after the
+ * letter (`adscript').
+ *
+ * The resulting mask selects the table, `capital_variant' or
+ * `small_variant', so no separate pass is needed.  If the capital doesn't
+ * exist (e.g. upsilon with smooth breathing in title case), the small letter
+ * is kept.
+ *
+ * The case mapping needs word_initial, so it is done by the engines which
+ * keep words.
+ */
+
+enum case_mode { CASE_NONE, CASE_UPPER, CASE_LOWER, CASE_TITLE, N_CASES };
+
+char *case_names[N_CASES] = { "none", "upper", "lower", "title" };
+
+struct case_map {
+    int clear;
+    int set;
+    int adscript;
+};
+
+struct case_map case_maps[N_CASES][2] = {   // [mode][word_initial]
+    { { 0, 0, 0 }, { 0, 0, 0 } },
+    {
+        { ~msk_no_breathings | ~msk_no_accents | ~msk_no_lengths | msk_iota,
+            msk_capital, 1 },
+        { ~msk_no_breathings | ~msk_no_accents | ~msk_no_lengths | msk_iota,
+            msk_capital, 1 }
+    },
+    { { msk_capital, 0, 0 }, { msk_capital, 0, 0 } },
+    { { msk_capital, 0, 0 }, { 0, msk_capital, 0 } }
+};
+
+ENGINE_INLINE void put_letter(int c, int mods, struct glyph *g, FILE *out,
+        struct config cf)
+{
+    if (cf.words && cf.case_mode != CASE_NONE) {
+        put_cased(c, mods, out, cf);
+    } else {
+        put_glyph(g, out, cf);
+    }
+    word_letter(c, mods, cf);
+}
+
+void put_cased(int c, int mods, FILE *out, struct config cf)
+{
+    struct case_map *m = &case_maps[(int) cf.case_mode][word_initial];
+
+    put_glyph(case_variant(c, mods, cf.case_mode), out, cf);
+    if ((mods & msk_iota) && m->adscript) {
+        PUT_GLYPH("Ι", out, cf);
+    }
+}
+
+struct glyph* case_variant(int c, int mods, int mode)
+{
+    struct case_map *m = &case_maps[mode][word_initial];
+    struct glyph *g;
+
+    c |= 0x20;
+    mods = (mods & ~m->clear) | m->set;
+    if ((mods & msk_capital)
+            && (g = capital_variant(c == 'j' ? 's' : c, mods))) {
+        return g;
+    }
+    return small_variant(c, mods & ~msk_capital);
+}
+
+/** `small_variant' is the lowercase counterpart of `capital_variant' without
+ * the checks: the modifiers come from a letter which has already been
+ * converted.  It is also used for the keys of the concordance.
+ */
+
+struct glyph* small_variant(char c, int mods)
+{
+    switch (c) {
+        CASE_RETURN('b', "β")
+        CASE_RETURN('c', "ξ")
+        CASE_RETURN('d', "δ")
+        CASE_RETURN('f', "φ")
+        CASE_RETURN('g', "γ")
+        CASE_RETURN('j', "ς")
+        CASE_RETURN('k', "κ")
+        CASE_RETURN('l', "λ")
+        CASE_RETURN('m', "μ")
+        CASE_RETURN('n', "ν")
+        CASE_RETURN('p', "π")
+        CASE_RETURN('q', "θ")
+        CASE_RETURN('s', "σ")
+        CASE_RETURN('t', "τ")
+        CASE_RETURN('v', "ϝ")
+        CASE_RETURN('x', "χ")
+        CASE_RETURN('y', "ψ")
+        CASE_RETURN('z', "ζ")
+        case 'a':
+            return alpha_variant(mods);
+        case 'e':
+            return eo_variant(mods, epsilon_variants);
+        case 'o':
+            return eo_variant(mods, omicron_variants);
+        case 'h':
+            return hw_variant(mods, eta_variants);
+        case 'w':
+            return hw_variant(mods, omega_variants);
+        case 'i':
+            return iy_variant(mods, iota_variants);
+        case 'u':
+            return iy_variant(mods, upsilon_variants);
+        case 'r':
+            if (mods & msk_rough) {
+                static struct glyph g = GLYPH("ῥ");
+                return &g;
+            } else if (mods & msk_smooth) {
+                static struct glyph g = GLYPH("ῤ");
+                return &g;
+            } else {
+                static struct glyph g = GLYPH("ρ");
+                return &g;
+            }
+        default:
+            return NULL;
+    }
+}
+
+
+/*
+ *                      Dehyphenation
+ */
+
+/** With -d a word split across lines with a hyphen, as in
+ *
+ *     ἄν-
+ *     θρωπος ἐστι
+ *
+ * is joined, and the line break is moved to the end of the word:
+ *
+ *     ἄνθρωπος
+ *      ἐστι
+ *
+ * The sigma before the hyphen is then decided by the joined word.  With -D a
+ * soft hyphen (U+00AD) is left where the word was split, so that the lines
+ * can be restored: replace the soft hyphen with a hyphen and a line break,
+ * and remove the next line break.
+ *
+ * A hyphen is a line break hyphen if it follows a letter, the line ends
+ * right after it, and the next line starts with a letter.  A word may go on
+ * over several lines, all of whose breaks are moved to its end, up to
+ * MAX_BREAKS of them; after that the hyphens are kept.  At most three
+ * characters are read after the hyphen, and nothing but a hyphen triggers
+ * the lookahead.  The word state is needed, so this is done by the engines
+ * which keep words.
+ */
+
+int is_letter(int c)
+{
+    return (('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z'));
+}
+
+/** `joins_line' tells whether a hyphen followed by brk and c can be dropped,
+ * provided it ends a word.
+ */
+
+int joins_line(int c, char *brk)
+{
+    return strchr(brk, '\n') && is_letter(c) && pending_breaks < MAX_BREAKS;
+}
+
+/** `read_line_break' is called after a hyphen.  It reads a line break, if
+ * there is one, and returns the next character; the characters read before
+ * it go to *brk: "", "\r", "\n" or "\r\n".
+ */
+
+static inline int read_line_break(FILE *in, char **brk, struct config cf)
+{
+    int c = lookahead(in, cf);
+
+    *brk = "";
+    if (c == '\r') {
+        *brk = "\r";
+        c = lookahead(in, cf);
+    }
+    if (c == '\n') {
+        *brk = **brk ? "\r\n" : "\n";
+        c = lookahead(in, cf);
+    }
+    return c;
+}
+
+/** `finish_hyphen' either joins the word, c being its next letter, or writes
+ * the hyphen and the characters read after it as they are.
+ */
+
+static inline void finish_hyphen(int c, char *brk, FILE *out, struct config cf)
+{
+    if (!word_initial && joins_line(c, brk)) {
+        if (brk[0] == '\r') pending_crlf |= (uint64_t) 1 << pending_breaks;
+        pending_breaks++;
+        if (cf.hyphens == HYPHENS_MARK) PUT_GLYPH("\u00ad", out, cf);
+    } else {
+        word_break(out, cf);
+        put_byte('-', out, cf);
+        put_ascii(brk, out, cf);
+    }
+}
+
+ENGINE_INLINE int dispatch_hyphen(FILE *in, FILE *out, struct config cf)
+{
+    char *brk;
+    int c = read_line_break(in, &brk, cf);
+
+    finish_hyphen(c, brk, out, cf);
+    return c;
+}
+
+
+/*
+ *                      Concordance
+ */
+
+/** With -c the conversion also builds a concordance: for every word form, the
+ * number of its occurrences and the input offsets where they begin.  Words
+ * are keyed on a normalized form: lowercase, grave turned into acute, and
+ * sigma final only at the end of the word.  The engine reports every letter
+ * with its modifiers to `word_letter', which builds the key right away, so
+ * the output is never read back.
+ *
+ * The forms live in a hash table whose entries and postings are allocated
+ * from an arena; the table and the arena together take -m megabytes.  When
+ * either is full, the forms are sorted and spilled as a run, and the arena
+ * is reset.  All the runs go one after another to the same temporary file.
+ * In the end they are merged into the index file, at most MERGE_FAN_IN at a
+ * time: while there are more, groups of them are first merged into longer
+ * runs in another temporary file.  So the memory and the file descriptors
+ * the merge takes don't depend on the size of the input.  The runs are
+ * written in the order of the input and merged in that order, so the
+ * postings stay sorted.
+ *
+ * The index is meant to be memory-mapped.  It is written in the native byte
+ * order:
+ *
+ *   struct index_header
+ *   uint64_t postings[n_tokens]        input offsets, grouped by form
+ *   char strings[]                     the forms in UTF-8, padded to 8 bytes
+ *   struct index_form forms[n_forms]   sorted by memcmp of the forms
+ *
+ * All the offsets in the header and in the forms are from the beginning of
+ * the file.
+ */
+
+struct index_header {
+    char magic[8];              // "BCGIDX1"
+    uint64_t n_forms;
+    uint64_t n_tokens;
+    uint64_t postings;
+    uint64_t strings;
+    uint64_t forms;
+};
+
+struct index_form {
+    uint64_t string;
+    uint64_t length;            // in bytes
+    uint64_t count;
+    uint64_t postings;
+};
+
+#define MAX_WORD 256
+#define POSTINGS_CHUNK 6
+
+struct postings {
+    struct postings *next;
+    uint64_t n;
+    uint64_t pos[POSTINGS_CHUNK];
+};
+
+struct form {
+    uint64_t count;
+    struct postings *first;
+    struct postings *last;
+    uint32_t hash;
+    uint32_t length;
+    char key[];
+};
+
+struct index {
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    struct form **table;
+    size_t table_size;          // a power of 2
+    size_t n_forms;
+    FILE *spill;
+    uint64_t *runs;             // offsets in spill; runs[n_runs] is the end
+    size_t n_runs;
+    uint64_t n_tokens;
+    char word[MAX_WORD];
+    size_t word_length;
+    uint64_t word_start;
+};
+
+struct index *concordance = NULL;
+
+ENGINE_INLINE void word_letter(int c, int mods, struct config cf)
+{
+    if (cf.words) {
+        word_initial = 0;
+        if (cf.index) index_letter(c, mods);
+    }
+}
+
+ENGINE_INLINE void word_break(FILE *out, struct config cf)
+{
+    if (cf.words) {
+        word_initial = 1;
+        if (cf.index) index_break();
+        if (pending_breaks) put_breaks(out, cf);
+    }
+}
+
+/** `put_breaks' writes the line breaks held by `finish_hyphen'. */
+
+void put_breaks(FILE *out, struct config cf)
+{
+    int i;
+
+    for (i = 0; i < pending_breaks; i++) {
+        put_ascii(pending_crlf >> i & 1 ? "\r\n" : "\n", out, cf);
+    }
+    pending_breaks = 0;
+    pending_crlf = 0;
+}
+
+/** `index_letter' appends a letter to the current word, `index_break' adds
+ * the word, if any, to the table.  Words longer than MAX_WORD bytes are
+ * truncated.
+ */
+
+void index_add(char *key, size_t length, uint64_t pos);
+
+void index_letter(int c, int mods)
+{
+    struct index *ix = concordance;
+    char *s;
+    size_t n;
+
+    if (!ix->word_length) ix->word_start = glyph_start;
+    if (mods & msk_grave) mods = (mods & ~msk_grave) | msk_acute;
+    c |= 0x20;
+    s = small_variant(c == 'j' ? 's' : c, mods & ~msk_capital)->utf8;
+    n = strlen(s);
+    if (ix->word_length + n <= MAX_WORD) {
+        memcpy(ix->word + ix->word_length, s, n);
+        ix->word_length += n;
+    }
+}
+
+void index_break(void)
+{
+    struct index *ix = concordance;
+    char *end = ix->word + ix->word_length;
+
+    if (!ix->word_length) return;
+    // σ is CF 83, ς is CF 82
+    if (ix->word_length >= 2 && !memcmp(end - 2, "σ", 2)) end[-1] = '\x82';
+    index_add(ix->word, ix->word_length, ix->word_start);
+    ix->word_length = 0;
+}
+
+void index_open(size_t budget)
+{
+    struct index *ix = calloc(1, sizeof(*ix));
+
+    // An eighth of the budget goes to the table.
+    ix->table_size = 1;
+    while (ix->table_size * 2 * sizeof(struct form *) <= budget / 8) {
+        ix->table_size *= 2;
+    }
+    ix->table = calloc(ix->table_size, sizeof(struct form *));
+    ix->arena_size = budget - ix->table_size * sizeof(struct form *);
+    ix->arena = malloc(ix->arena_size);
+    ix->runs = calloc(1, sizeof(uint64_t));
+    if (!ix->table || !ix->arena || !ix->runs) {
+        fprintf(stderr, "Cannot allocate %zu bytes for the concordance.\n", budget);
+        exit(1);
+    }
+    concordance = ix;
+}
+
+void* arena_alloc(struct index *ix, size_t size)
+{
+    void *p = ix->arena + ix->arena_used;
+
+    size = (size + 7) & ~(size_t) 7;
+    if (ix->arena_size - ix->arena_used < size) return NULL;
+    ix->arena_used += size;
+    return p;
+}
+
+int compare_keys(char *a, size_t alength, char *b, size_t blength)
+{
+    int r = memcmp(a, b, alength < blength ? alength : blength);
+
+    if (r) return r;
+    return (alength > blength) - (alength < blength);
+}
+
+int compare_forms(const void *a, const void *b)
+{
+    struct form *f = *(struct form **) a;
+    struct form *g = *(struct form **) b;
+
+    return compare_keys(f->key, f->length, g->key, g->length);
+}
+
+FILE* temporary_file(void)
+{
+    FILE *f = tmpfile();
+
+    if (!f) {
+        fprintf(stderr, "Cannot create a temporary file.\n");
+        exit(1);
+    }
+    return f;
+}
+
+/** A run is a sequence of records
+ *
+ *   uint64_t length; char key[length]; uint64_t count; uint64_t pos[count];
+ *
+ * sorted by key.  `run_record' writes a record up to the postings.
+ * `run_end' makes sure a file of runs is written out, and returns its end.
+ */
+
+void run_record(FILE *run, char *key, uint64_t length, uint64_t count)
+{
+    fwrite(&length, sizeof(length), 1, run);
+    fwrite(key, 1, length, run);
+    fwrite(&count, sizeof(count), 1, run);
+}
+
+uint64_t run_end(FILE *run)
+{
+    off_t end;
+
+    if (fflush(run) || ferror(run) || (end = ftello(run)) < 0) {
+        fprintf(stderr, "Cannot write to a temporary file.\n");
+        exit(1);
+    }
+    return end;
+}
+
+void index_spill(struct index *ix)
+{
+    struct postings *p;
+    struct form *f;
+    size_t i;
+    size_t n = 0;
+
+    if (!ix->spill) ix->spill = temporary_file();
+    for (i = 0; i < ix->table_size; i++) {
+        if (ix->table[i]) ix->table[n++] = ix->table[i];
+    }
+    qsort(ix->table, n, sizeof(struct form *), compare_forms);
+    for (i = 0; i < n; i++) {
+        f = ix->table[i];
+        run_record(ix->spill, f->key, f->length, f->count);
+        for (p = f->first; p; p = p->next) {
+            fwrite(p->pos, sizeof(uint64_t), p->n, ix->spill);
+        }
+    }
+    ix->runs = realloc(ix->runs, (ix->n_runs + 2) * sizeof(uint64_t));
+    ix->runs[++ix->n_runs] = run_end(ix->spill);
+
+    memset(ix->table, 0, ix->table_size * sizeof(struct form *));
+    ix->n_forms = 0;
+    ix->arena_used = 0;
+}
+
+uint32_t hash_key(char *key, size_t length)
+{
+    uint32_t h = 2166136261u;
+
+    while (length--) h = (h ^ (unsigned char) *key++) * 16777619u;
+    return h;
+}
+
+void index_add(char *key, size_t length, uint64_t pos)
+{
+    struct index *ix = concordance;
+    uint32_t h = hash_key(key, length);
+    size_t mask = ix->table_size - 1;
+    size_t i = h & mask;
+    struct form *f;
+    struct postings *p;
+
+    while ((f = ix->table[i])) {
+        if (f->hash == h && f->length == length
+                && !memcmp(f->key, key, length)) break;
+        i = (i + 1) & mask;
+    }
+    if (!f) {
+        if (ix->n_forms >= ix->table_size / 4 * 3
+                || !(f = arena_alloc(ix, sizeof(struct form) + length))) {
+            index_spill(ix);
+            index_add(key, length, pos);
+            return;
+        }
+        f->count = 0;
+        f->first = f->last = NULL;
+        f->hash = h;
+        f->length = length;
+        memcpy(f->key, key, length);
+        ix->table[i] = f;
+        ix->n_forms++;
+    }
+    if (!(p = f->last) || p->n == POSTINGS_CHUNK) {
+        if (!(p = arena_alloc(ix, sizeof(struct postings)))) {
+            index_spill(ix);
+            index_add(key, length, pos);
+            return;
+        }
+        p->next = NULL;
+        p->n = 0;
+        if (f->last) {
+            f->last->next = p;
+        } else {
+            f->first = p;
+        }
+        f->last = p;
+    }
+    p->pos[p->n++] = pos;
+    f->count++;
+    ix->n_tokens++;
+}
+
+/** Merging.  Each run being merged has a cursor holding its current record
+ * up to the postings, which are then copied straight to the output.  The
+ * cursors read their runs with pread through buffers of their own, so they
+ * share the descriptor of the file.  The cursors whose records come next
+ * are kept in a heap, ordered by the key and then by the run, so that the
+ * postings of a form come out in the order of the input.
+ */
+
+#define MERGE_FAN_IN 16
+#define CURSOR_BUFFER (64 << 10)
+
+struct cursor {
+    int fd;
+    uint64_t pos;               // the next byte to read into the buffer
+    uint64_t end;               // the end of the run
+    char *buf;
+    size_t next;
+    size_t fill;
+    size_t run;
+    uint64_t length;
+    uint64_t count;
+    char key[MAX_WORD];
+};
+
+/** `cursor_read' reads n bytes of the run, or whatever is left of it. */
+
+size_t cursor_read(struct cursor *c, void *to, size_t n)
+{
+    size_t done = 0;
+    size_t m;
+    ssize_t r;
+
+    while (done < n) {
+        if (c->next == c->fill) {
+            m = c->end - c->pos < CURSOR_BUFFER ? c->end - c->pos
+                : CURSOR_BUFFER;
+            if (!m) break;
+            if ((r = pread(c->fd, c->buf, m, c->pos)) <= 0) {
+                fprintf(stderr, "Cannot read from a temporary file.\n");
+                exit(1);
+            }
+            c->pos += r;
+            c->next = 0;
+            c->fill = r;
+        }
+        m = c->fill - c->next < n - done ? c->fill - c->next : n - done;
+        memcpy((char *) to + done, c->buf + c->next, m);
+        c->next += m;
+        done += m;
+    }
+    return done;
+}
+
+/** `cursor_next' reads the next record and tells whether there was one. */
+
+int cursor_next(struct cursor *c)
+{
+    return cursor_read(c, &c->length, sizeof(c->length)) == sizeof(c->length)
+        && c->length <= MAX_WORD
+        && cursor_read(c, c->key, c->length) == c->length
+        && cursor_read(c, &c->count, sizeof(c->count)) == sizeof(c->count);
+}
+
+void cursor_copy(struct cursor *c, FILE *to, uint64_t n)
+{
+    char buf[BUFSIZ];
+    size_t m;
+
+    while (n) {
+        m = n < sizeof(buf) ? n : sizeof(buf);
+        if (cursor_read(c, buf, m) != m) {
+            fprintf(stderr, "Cannot read from a temporary file.\n");
+            exit(1);
+        }
+        fwrite(buf, 1, m, to);
+        n -= m;
+    }
+}
+
+int cursor_less(struct cursor *a, struct cursor *b)
+{
+    int r = compare_keys(a->key, a->length, b->key, b->length);
+
+    return r < 0 || (!r && a->run < b->run);
+}
+
+void heap_up(struct cursor **heap, size_t i)
+{
+    struct cursor *c = heap[i];
+
+    while (i && cursor_less(c, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+}
+
+void heap_down(struct cursor **heap, size_t n, size_t i)
+{
+    struct cursor *c = heap[i];
+    size_t j;
+
+    while ((j = 2 * i + 1) < n) {
+        if (j + 1 < n && cursor_less(heap[j + 1], heap[j])) j++;
+        if (!cursor_less(heap[j], c)) break;
+        heap[i] = heap[j];
+        i = j;
+    }
+    heap[i] = c;
+}
+
+/** The final merge writes the index: the postings directly to the index
+ * file, the strings and the forms to temporary files, which are appended at
+ * the end.  The size of the postings is known in advance, so the offsets of
+ * the strings are known as well.
+ */
+
+struct index_output {
+    FILE *out;
+    FILE *strings;
+    FILE *forms;
+    struct index_header header;
+    uint64_t strings_size;
+};
+
+/** `merge_runs' merges the runs first to first + n - 1 of the file fd,
+ * runs[i] being where run i begins, into a single run written to `run', or,
+ * if `run' is NULL, into the index.
+ */
+
+void merge_runs(int fd, uint64_t *runs, size_t first, size_t n, FILE *run,
+        struct index_output *ix)
+{
+    struct cursor cursors[MERGE_FAN_IN];
+    struct cursor *heap[MERGE_FAN_IN];
+    struct cursor *same[MERGE_FAN_IN];
+    struct index_form form;
+    char key[MAX_WORD];
+    uint64_t length;
+    uint64_t count;
+    size_t n_heap = 0;
+    size_t n_same;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        cursors[i].fd = fd;
+        cursors[i].pos = runs[first + i];
+        cursors[i].end = runs[first + i + 1];
+        cursors[i].buf = malloc(CURSOR_BUFFER);
+        cursors[i].next = cursors[i].fill = 0;
+        cursors[i].run = i;
+        if (!cursors[i].buf) {
+            fprintf(stderr, "Cannot allocate memory for the merge.\n");
+            exit(1);
+        }
+        if (cursor_next(&cursors[i])) {
+            heap[n_heap] = &cursors[i];
+            heap_up(heap, n_heap++);
+        }
+    }
+    while (n_heap) {
+        length = heap[0]->length;
+        memcpy(key, heap[0]->key, length);
+        count = 0;
+        for (n_same = 0; n_heap && !compare_keys(heap[0]->key,
+                    heap[0]->length, key, length); n_same++) {
+            same[n_same] = heap[0];
+            count += heap[0]->count;
+            heap[0] = heap[--n_heap];
+            if (n_heap) heap_down(heap, n_heap, 0);
+        }
+        if (run) {
+            run_record(run, key, length, count);
+        } else {
+            form.string = ix->header.strings + ix->strings_size;
+            form.length = length;
+            form.count = count;
+            form.postings = ftello(ix->out);
+            fwrite(key, 1, length, ix->strings);
+            ix->strings_size += length;
+            fwrite(&form, sizeof(form), 1, ix->forms);
+            ix->header.n_forms++;
+        }
+        // The cursors come out of the heap in the order of the runs.
+        for (i = 0; i < n_same; i++) {
+            cursor_copy(same[i], run ? run : ix->out,
+                    same[i]->count * sizeof(uint64_t));
+            if (cursor_next(same[i])) {
+                heap[n_heap] = same[i];
+                heap_up(heap, n_heap++);
+            }
+        }
+    }
+    for (i = 0; i < n; i++) free(cursors[i].buf);
+}
+
+void copy_bytes(FILE *from, FILE *to, uint64_t n)
+{
+    char buf[BUFSIZ];
+    size_t m;
+
+    while (n && (m = fread(buf, 1, n < sizeof(buf) ? n : sizeof(buf), from))) {
+        fwrite(buf, 1, m, to);
+        n -= m;
+    }
+}
+
+void index_finish(char *path)
+{
+    struct index *ix = concordance;
+    struct index_output o = { NULL, NULL, NULL,
+        { "BCGIDX1", 0, 0, 0, 0, 0 }, 0 };
+    FILE *merged;
+    uint64_t *runs;
+    size_t n_runs;
+    size_t i;
+
+    index_spill(ix);
+    free(ix->arena);
+    free(ix->table);
+
+    // Merge the runs in groups until one group is left.
+    while (ix->n_runs > MERGE_FAN_IN) {
+        merged = temporary_file();
+        n_runs = (ix->n_runs + MERGE_FAN_IN - 1) / MERGE_FAN_IN;
+        runs = malloc((n_runs + 1) * sizeof(uint64_t));
+        runs[0] = 0;
+        for (i = 0; i < n_runs; i++) {
+            merge_runs(fileno(ix->spill), ix->runs, i * MERGE_FAN_IN,
+                    i == n_runs - 1 ? ix->n_runs - i * MERGE_FAN_IN
+                    : MERGE_FAN_IN, merged, NULL);
+            runs[i + 1] = run_end(merged);
+        }
+        fclose(ix->spill);
+        free(ix->runs);
+        ix->spill = merged;
+        ix->runs = runs;
+        ix->n_runs = n_runs;
+    }
+
+    o.out = fopen(path, "w");
+    if (!o.out) {
+        fprintf(stderr, "Cannot write to file %s.\n", path);
+        exit(1);
+    }
+    o.strings = temporary_file();
+    o.forms = temporary_file();
+    o.header.n_tokens = ix->n_tokens;
+    o.header.postings = sizeof(o.header);
+    o.header.strings = o.header.postings + ix->n_tokens * sizeof(uint64_t);
+    fwrite(&o.header, sizeof(o.header), 1, o.out);
+
+    merge_runs(fileno(ix->spill), ix->runs, 0, ix->n_runs, NULL, &o);
+    fclose(ix->spill);
+    free(ix->runs);
+
+    fwrite("\0\0\0\0\0\0\0", 1, -o.strings_size & 7, o.strings);
+    o.header.forms = o.header.strings
+        + ((o.strings_size + 7) & ~(uint64_t) 7);
+    rewind(o.strings);
+    copy_bytes(o.strings, o.out, o.header.forms - o.header.strings);
+    rewind(o.forms);
+    copy_bytes(o.forms, o.out, o.header.n_forms * sizeof(struct index_form));
+    fclose(o.strings);
+    fclose(o.forms);
+
+    rewind(o.out);
+    fwrite(&o.header, sizeof(o.header), 1, o.out);
+    if (ferror(o.out) || fclose(o.out)) {
+        fprintf(stderr, "Cannot write to file %s.\n", path);
+        exit(1);
+    }
+    free(ix);
+    concordance = NULL;
+}
+
+
+/*
+ *                      Checkpoints
+ */
+
+/** With -k the conversion records its state in a checkpoint file every
+ * checkpoint_interval bytes of input, and with -r it starts from the recorded
+ * state instead of the beginning.  A checkpoint is taken between two glyphs
+ * (see `convert'), so the modifiers of a letter, the `*' of a capital and the
+ * character after a sigma are never half read: the dispatcher only holds the
+ * character it has read ahead.  Besides that character, a checkpoint holds
+ * the offsets in the input and in the output, the UTF-8 sequence which
+ * `put_byte' may be in the middle of, whether we are inside a word (for the
+ * title case) and the line breaks moved to its end (for the dehyphenation),
+ * and the options which determine the output, so that a resumed run writes
+ * exactly what the interrupted one would have written.
+ *
+ * The output is flushed and synced before the checkpoint, which is written to
+ * a temporary file and renamed over the previous one.
+ *
+ * The end of the input decides the glyph and the word being read: a letter
+ * stops waiting for its modifiers, a sigma becomes final, the held line
+ * breaks are written.  Once the input has grown, they may come out
+ * differently.  So the final checkpoint is taken by `input_end' as soon as
+ * the input ends, before any of that is written, at the beginning of the
+ * glyph being read, or at the end if it ends between two glyphs.  Resuming
+ * later converts that glyph again along with what has been appended in the
+ * meantime, and the output is the same as if the input had been whole from
+ * the start.  With -F we don't stop at the end of the input at all, but wait
+ * for more.
+ */
+
+#define FOLLOW_INTERVAL 250000  // microseconds
+
+/** `checkpoint_write' records that the conversion goes on from the offset
+ * pos of the input, c having been read ahead.
+ */
+
+void checkpoint_write(uint64_t pos, int c, FILE *out, struct config cf)
+{
+    char *tmp = malloc(strlen(checkpoint_path) + 5);
+    FILE *f;
+    off_t out_pos;
+
+    if (!tmp) {
+        fprintf(stderr, "Cannot allocate memory for the checkpoint.\n");
+        exit(1);
+    }
+    if (fflush(out) || fsync(fileno(out)) || (out_pos = ftello(out)) < 0) {
+        fprintf(stderr, "Cannot write the output before the checkpoint.\n");
+        exit(1);
+    }
+    sprintf(tmp, "%s.tmp", checkpoint_path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write to file %s.\n", tmp);
+        exit(1);
+    }
+    fprintf(f, "bcgreek checkpoint\n");
+    fprintf(f, "input %" PRIu64 "\n", pos);
+    fprintf(f, "output %" PRIu64 "\n", (uint64_t) out_pos);
+    fprintf(f, "pending %d\n", c);
+    fprintf(f, "decoder %" PRIu32 " %d\n", (uint32_t) byte_code, byte_more);
+    fprintf(f, "word %d %d %" PRIu64 "\n", word_initial, pending_breaks,
+            pending_crlf);
+    fprintf(f, "options %d %s %s %d\n", cf.smart_sigma,
+            encoding_names[cf.encoding], case_names[(int) cf.case_mode],
+            cf.hyphens);
+    if (fflush(f) || fsync(fileno(f)) || fclose(f)
+            || rename(tmp, checkpoint_path)) {
+        fprintf(stderr, "Cannot write to file %s.\n", checkpoint_path);
+        exit(1);
+    }
+    free(tmp);
+    next_checkpoint = pos + checkpoint_interval;
+}
+
+/** `checkpoint_read' restores the state and positions both streams.  The
+ * output is truncated to the recorded offset, dropping whatever was written
+ * after the checkpoint.
+ */
+
+void checkpoint_read(FILE *in, FILE *out, struct config cf)
+{
+    FILE *f = fopen(checkpoint_path, "r");
+    uint64_t out_pos;
+    uint32_t code;
+    int sigma;
+    int hyphens;
+    char name[16];
+    char case_name[16];
+
+    if (!f) {
+        fprintf(stderr, "Cannot read from file %s.\n", checkpoint_path);
+        exit(1);
+    }
+    if (fscanf(f, "bcgreek checkpoint input %" SCNu64 " output %" SCNu64
+                " pending %d decoder %" SCNu32 " %d word %d %d %" SCNu64
+                " options %d %15s %15s %d",
+                &in_pos, &out_pos, &resume_char, &code, &byte_more,
+                &word_initial, &pending_breaks, &pending_crlf, &sigma, name,
+                case_name, &hyphens) != 12
+            || pending_breaks < 0 || pending_breaks > MAX_BREAKS) {
+        fprintf(stderr, "Invalid checkpoint %s.\n", checkpoint_path);
+        exit(1);
+    }
+    fclose(f);
+    byte_code = code;
+    if (sigma != cf.smart_sigma || strcmp(name, encoding_names[cf.encoding])
+            || strcmp(case_name, case_names[(int) cf.case_mode])
+            || hyphens != cf.hyphens) {
+        fprintf(stderr, "The checkpoint %s was made with different options.\n",
+                checkpoint_path);
+        exit(1);
+    }
+    if (fseeko(in, in_pos, SEEK_SET) || fflush(out)
+            || ftruncate(fileno(out), out_pos)
+            || fseeko(out, out_pos, SEEK_SET)) {
+        fprintf(stderr, "Cannot resume from the checkpoint %s.\n",
+                checkpoint_path);
+        exit(1);
+    }
+    next_checkpoint = in_pos + checkpoint_interval;
+}
+
+/** `input_end' is called when the input ends, pos being where the glyph
+ * being read began, or in_pos between two glyphs.  Nothing has been written
+ * for that glyph yet.  With -F it waits for more input, otherwise the final
+ * checkpoint is taken, once: the dispatcher may find the end of the input
+ * again while it finishes.
+ */
+
+int input_end(FILE *in, uint64_t pos, struct config cf)
+{
+    if (cf.follow) return follow_char(in);
+    if (checkpoint_path && next_checkpoint != UINT64_MAX) {
+        checkpoint_write(pos, PAUSE, checkpoint_out, cf);
+        next_checkpoint = UINT64_MAX;
+    }
+    return EOF;
+}
+
+/** `follow_char' waits until the input grows.  The output is flushed first,
+ * so that it can be followed in turn.
+ */
+
+int follow_char(FILE *in)
+{
+    int c;
+
+    do {
+        fflush(NULL);
+        usleep(FOLLOW_INTERVAL);
+        clearerr(in);
+    } while ((c = getc(in)) == EOF && !ferror(in));
+    return c;
+}
+
+
+/*
+ *                      Engines
+ */
+
+/** An engine is `convert' specialized for one value of smart_sigma, words,
+ * count and utf8.  ENGINE defines one, which sets these four in the config it
+ * is given and leaves the others as they are.  The table `engines' is indexed
+ * by `select_engine' with the options parsed in main.  Each dimension
+ * doubles the engines and the build time, so only the options which change
+ * the dispatch itself deserve one.
+ */
+
+typedef void (*engine)(FILE *in, FILE *out, struct config cf);
+
+#define ENGINE_NAME(sigma, words, count, utf8) \
+    convert_ ## sigma ## words ## count ## utf8
+
+#define ENGINE(sigma, wrd, cnt, u8) \
+    void ENGINE_NAME(sigma, wrd, cnt, u8)(FILE *in, FILE *out, \
+            struct config cf) \
+    { \
+        cf.smart_sigma = sigma; \
+        cf.words = wrd; \
+        cf.count = cnt; \
+        cf.utf8 = u8; \
+        convert(in, out, cf); \
+    }
+
+#define ENGINES(sigma, wrd) \
+    ENGINE(sigma, wrd, 0, 0) \
+    ENGINE(sigma, wrd, 0, 1) \
+    ENGINE(sigma, wrd, 1, 0) \
+    ENGINE(sigma, wrd, 1, 1)
+
+#define ENGINE_NAMES(sigma, wrd) \
+    { { ENGINE_NAME(sigma, wrd, 0, 0), ENGINE_NAME(sigma, wrd, 0, 1) }, \
+      { ENGINE_NAME(sigma, wrd, 1, 0), ENGINE_NAME(sigma, wrd, 1, 1) } }
+
+ENGINES(0, 0)
+ENGINES(0, 1)
+ENGINES(1, 0)
+ENGINES(1, 1)
+
+engine engines[2][2][2][2] = {
+    { ENGINE_NAMES(0, 0), ENGINE_NAMES(0, 1) },
+    { ENGINE_NAMES(1, 0), ENGINE_NAMES(1, 1) }
+};
+
+engine select_engine(struct config cf)
+{
+    return engines[!!cf.smart_sigma][!!cf.words][!!cf.count][!!cf.utf8];
+}
+
+
+/*
+ *                      Profiling
+ */
+
+/** With -p the conversion is measured as it runs, from the input to the
+ * output, by the engine selected by the options, which is named in the
+ * report.  The hardware counters are read through perf_event_open; if the
+ * kernel refuses some of them (no PMU in a virtual machine,
+ * perf_event_paranoid, seccomp), the corresponding columns show `-' and the
+ * wall clock time is still reported.  The counters leave out the kernel, so
+ * they show the dispatch loop and stdio rather than the reads and writes;
+ * the wall clock time includes everything.  Elsewhere than on Linux only
+ * the time is reported.
+ *
+ * The counters are opened independently rather than as a group, so that one
+ * missing event doesn't take the others with it.  Their values are scaled by
+ * the time they actually ran in case the kernel multiplexes them.
+ */
+
+enum { CNT_CYCLES, CNT_INSTRUCTIONS, CNT_BRANCHES, CNT_BRANCH_MISSES,
+    CNT_CACHE_MISSES, N_COUNTERS };
+
+#ifdef __linux__
+int counter_configs[N_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_MISSES
+};
+#endif
+
+struct profile {
+    int fd[N_COUNTERS];
+    double value[N_COUNTERS];   // negative if unavailable
+    struct timespec start;
+    double seconds;
+};
+
+#ifdef __linux__
+void profile_open(struct profile *p, FILE *err)
+{
+    struct perf_event_attr attr;
+    int i;
+    int errnum = 0;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counter_configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (p->fd[i] < 0) errnum = errno;
+    }
+    if (p->fd[CNT_CYCLES] < 0 && p->fd[CNT_INSTRUCTIONS] < 0) {
+        fprintf(err, "bcgreek: hardware counters unavailable (%s), "
+                "reporting time only\n", strerror(errnum));
+    }
+}
+#else
+void profile_open(struct profile *p, FILE *err)
+{
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) p->fd[i] = -1;
+    fprintf(err, "bcgreek: hardware counters unavailable on this system, "
+            "reporting time only\n");
+}
+#endif
+
+void profile_close(struct profile *p)
+{
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+        if (p->fd[i] >= 0) close(p->fd[i]);
+    }
+}
+
+void profile_start(struct profile *p)
+{
+    int i;
+
+    for (i = 0; i < N_COUNTERS; i++) {
+#ifdef __linux__
+        if (p->fd[i] >= 0) {
+            ioctl(p->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+void profile_stop(struct profile *p)
+{
+    struct timespec end;
+    unsigned long long v[3];    // value, time enabled, time running
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < N_COUNTERS; i++) {
+        p->value[i] = -1;
+        if (p->fd[i] < 0) continue;
+#ifdef __linux__
+        ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+        if (read(p->fd[i], v, sizeof(v)) == sizeof(v) && v[2]) {
+            p->value[i] = (double) v[0] * v[1] / v[2];
+        }
+    }
+    p->seconds = (end.tv_sec - p->start.tv_sec)
+        + (end.tv_nsec - p->start.tv_nsec) / 1e9;
+}
+
+/** `profile_report' prints a line per phase: the time, cycles and
+ * instructions per byte, the share of mispredicted branches and the cache
+ * misses per kilobyte.
+ */
+
+void profile_report(char *phase, struct profile *p, size_t bytes, FILE *err)
+{
+    double *v = p->value;
+    double n = bytes ? bytes : 1;
+
+    fprintf(err, "%-10s %12zu %10.3f", phase, bytes, p->seconds * 1e3);
+    if (v[CNT_CYCLES] >= 0) {
+        fprintf(err, " %10.2f", v[CNT_CYCLES] / n);
+    } else {
+        fprintf(err, " %10s", "-");
+    }
+    if (v[CNT_INSTRUCTIONS] >= 0) {
+        fprintf(err, " %10.2f", v[CNT_INSTRUCTIONS] / n);
+    } else {
+        fprintf(err, " %10s", "-");
+    }
+    if (v[CNT_BRANCHES] > 0 && v[CNT_BRANCH_MISSES] >= 0) {
+        fprintf(err, " %11.2f%%", 100 * v[CNT_BRANCH_MISSES] / v[CNT_BRANCHES]);
+    } else {
+        fprintf(err, " %12s", "-");
+    }
+    if (v[CNT_CACHE_MISSES] >= 0) {
+        fprintf(err, " %14.2f\n", v[CNT_CACHE_MISSES] * 1024 / n);
+    } else {
+        fprintf(err, " %14s\n", "-");
+    }
+}
+
+/** The cost per byte depends on what the bytes are, so the engine is also
+ * run over a slice of each input class, in the terms of the dispatcher:
+ * letters without diacritics (`plain'), vowels and rho without modifiers,
+ * which look ahead for them once (`vowel'), vowels with modifiers, counted
+ * together with them (`accented', that is `read_mods'), sigma, capitals with
+ * their `*' and modifiers (`capital', that is `dispatch_capital') and
+ * everything else, which is copied as it is.  A slice is PROFILE_SLICE bytes
+ * of the pattern of its class, converted from a temporary file to /dev/null
+ * without the concordance.  The share of each class in the input is reported
+ * as well, so that the slices can be weighed.
+ */
+
+enum { CLS_PLAIN, CLS_VOWEL, CLS_ACCENTED, CLS_SIGMA, CLS_CAPITAL, CLS_OTHER,
+    N_CLASSES };
+
+char *class_names[N_CLASSES] = {
+    "plain", "vowel", "accented", "sigma", "capital", "other"
+};
+
+char *class_patterns[N_CLASSES] = {
+    "bdgklmnpqtxz", "aehiouwr", "a)/h(=|i+w/|e\\u(o)", "s", "*a*)b*(/h*w|",
+    " ,.;\n"
+};
+
+#define PROFILE_SLICE (1 << 20)
+
+/** `byte_class' gives the class of c, given the class of the byte before it
+ * and whether a `*' is still waiting for its letter.  A vowel only turns
+ * out to be accented when a modifier follows it, see `profile_classes'.
+ */
+
+int is_modifier(int c)
+{
+    // strchr would match the terminating null
+    return c && strchr(")(/\\=|+&'", c);
+}
+
+int byte_class(int c, int prev, int *star)
+{
+    if (*star) {
+        if (is_modifier(c)) return CLS_CAPITAL;
+        *star = 0;
+        if (is_letter(c)) return CLS_CAPITAL;
+    }
+    if (c == '*') {
+        *star = 1;
+        return CLS_CAPITAL;
+    }
+    if (is_modifier(c)) {
+        return prev == CLS_VOWEL || prev == CLS_ACCENTED ? CLS_ACCENTED
+            : CLS_OTHER;
+    }
+    if (c == 's' || c == 'S') return CLS_SIGMA;
+    if (c && strchr("aehiouwrAEHIOUWR", c)) return CLS_VOWEL;
+    if (is_letter(c)) return CLS_PLAIN;
+    return CLS_OTHER;
+}
+
+/** `profile_classes' reads the input once more, which is why -p needs a
+ * seekable input.
+ */
+
+void profile_classes(FILE *in, FILE *err)
+{
+    size_t count[N_CLASSES] = {0};
+    size_t size = 0;
+    size_t i;
+    double n;
+    int c;
+    int class;
+    int prev = CLS_OTHER;
+    int star = 0;
+
+    rewind(in);
+    while ((c = getc(in)) != EOF) {
+        class = byte_class(c, prev, &star);
+        if (class == CLS_ACCENTED && prev == CLS_VOWEL) {
+            count[CLS_VOWEL]--;
+            count[CLS_ACCENTED]++;
+        }
+        count[class]++;
+        prev = class;
+        size++;
+    }
+    n = size ? size : 1;
+    fprintf(err, "input:");
+    for (i = 0; i < N_CLASSES; i++) {
+        fprintf(err, " %s %.1f%%", class_names[i], 100 * count[i] / n);
+    }
+    fprintf(err, "\n");
+}
+
+void profile_slice(engine run, struct config cf, int class, struct profile *p,
+        FILE *err)
+{
+    FILE *in = temporary_file();
+    FILE *out = fopen("/dev/null", "w");
+    char *pattern = class_patterns[class];
+    size_t n = strlen(pattern);
+    size_t size;
+
+    if (!out) {
+        fprintf(stderr, "Cannot write to file /dev/null.\n");
+        exit(1);
+    }
+    for (size = 0; size + n <= PROFILE_SLICE; size += n) fputs(pattern, in);
+    rewind(in);
+    word_initial = 1;
+    profile_start(p);
+    run(in, out, cf);
+    fflush(out);
+    profile_stop(p);
+    profile_report(class_names[class], p, size, err);
+    fclose(in);
+    fclose(out);
+}
+
+void profile_convert(struct config cf, FILE *in, FILE *out, FILE *err)
+{
+    engine run = select_engine(cf);
+    struct profile p;
+    int i;
+
+    profile_open(&p, err);
+    fprintf(err, "engine: smart sigma %s, words %s, count %s, %s\n",
+            cf.smart_sigma ? "on" : "off", cf.words ? "on" : "off",
+            cf.count ? "on" : "off", encoding_names[cf.encoding]);
+    fprintf(err, "%-10s %12s %10s %10s %10s %12s %14s\n", "phase", "bytes",
+            "ms", "cycles/B", "instr/B", "branch-miss", "cache-miss/KB");
+
+    profile_start(&p);
+    run(in, out, cf);
+    fflush(out);
+    profile_stop(&p);
+    profile_report("convert", &p, ftello(in), err);
+
+    cf.index = 0;
+    cf.follow = 0;
+    for (i = 0; i < N_CLASSES; i++) profile_slice(run, cf, i, &p, err);
+    profile_classes(in, err);
+    profile_close(&p);
+}
+
+
+/*
+ *                      User interface
+ */
+
+void usage(FILE *out)
+{
+    fprintf(out, "usage: bcgreek [-s] [-i] [-t timeout] [-e encoding] [-C case] [-d | -D] [-p]\n");
+    fprintf(out, "               [-c index_file] [-m megabytes] [-k checkpoint_file] [-n bytes]\n");
+    fprintf(out, "               [-r] [-F]\n");
+    fprintf(out, "               [-f input_file] [-x string] [-o output_file]\n");
+    fprintf(out, "Convert beta code into polytonic Greek.\n");
+    fprintf(out, "  -s                    automatically convert S into final sigma\n");
+    fprintf(out, "  -i                    interactive mode: flush the output whenever the input\n");
+    fprintf(out, "                          pauses\n");
+    fprintf(out, "  -t timeout            in the interactive mode, convert a letter waiting for\n");
+    fprintf(out, "                          modifiers after timeout milliseconds (default 500)\n");
+    fprintf(out, "  -e encoding           output encoding: utf-8 (default), utf-16le, utf-16be,\n");
+    fprintf(out, "                          utf-32le or utf-32be\n");
+    fprintf(out, "  -p                    profile: report time and hardware counters of the\n");
+    fprintf(out, "                          conversion, and of slices of each input class, to\n");
+    fprintf(out, "                          standard error; needs a seekable input\n");
+    fprintf(out, "  -C case               put the letters into upper case without diacritics\n");
+    fprintf(out, "                          (upper), lower case (lower) or title case (title)\n");
+    fprintf(out, "  -d                    join words hyphenated across line breaks\n");
+    fprintf(out, "  -D                    like -d, but mark the joins with a soft hyphen\n");
+    fprintf(out, "  -c index_file         write a concordance of the normalized word forms to\n");
+    fprintf(out, "                          index_file\n");
+    fprintf(out, "  -m megabytes          memory for the concordance before spilling to\n");
+    fprintf(out, "                          temporary files (default 64)\n");
+    fprintf(out, "  -k checkpoint_file    record the progress in checkpoint_file; needs -f and\n");
+    fprintf(out, "                          -o\n");
+    fprintf(out, "  -n bytes              take a checkpoint every so many bytes of input\n");
+    fprintf(out, "                          (default 67108864)\n");
+    fprintf(out, "  -r                    resume from the checkpoint, appending to the output\n");
+    fprintf(out, "  -F                    at the end of the input, wait for it to grow\n");
+    fprintf(out, "  -f input_file         input file; if this option is missing, standard input\n");
+    fprintf(out, "                          is used\n");
+    fprintf(out, "  -x string             process string\n");
+    fprintf(out, "  -o output_file        output file; if this option is missing, standard\n");
+    fprintf(out, "                          output is used\n");
+    fprintf(out, "  -h                    display this help and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in;
+    FILE *out;
+    int oc;
+    struct config cf = { 0, 0, 0, 1, 0, UTF8, CASE_NONE, HYPHENS_KEEP, 0, 0 };
+
+    int sflag = 0;
+    int iflag = 0;
+    int pflag = 0;
+    int cflag = 0;
+    int kflag = 0;
+    int rflag = 0;
+    int Fflag = 0;
+    long mvalue = 64;
+    long long nvalue;
+    int fflag = 0;
+    int oflag = 0;
+    int xflag = 0;
+    char *cvalue = NULL;
+    char *fvalue = NULL;
+    char *ovalue;
+    char *xvalue;
+    char *end;
+
+    while ((oc = getopt(argc, argv, "sit:e:C:dDpc:m:k:n:rFf:o:hx:")) != -1) {
+        switch (oc) {
+            case 's':
+                sflag = 1;
+                break;
+            case 'i':
+                iflag = 1;
+                break;
+            case 't':
+                idle_timeout = strtol(optarg, &end, 10);
+                if (*end || idle_timeout < 0) {
+                    fprintf(stderr, "%s: Invalid timeout %s.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                for (cf.encoding = 0; cf.encoding < N_ENCODINGS; cf.encoding++) {
+                    if (!strcmp(optarg, encoding_names[cf.encoding])) break;
+                }
+                if (cf.encoding == N_ENCODINGS) {
+                    fprintf(stderr, "%s: Unknown encoding %s.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                for (cf.case_mode = CASE_UPPER; cf.case_mode < N_CASES;
+                        cf.case_mode++) {
+                    if (!strcmp(optarg, case_names[(int) cf.case_mode])) break;
+                }
+                if (cf.case_mode == N_CASES) {
+                    fprintf(stderr, "%s: Unknown case %s.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                cf.hyphens = HYPHENS_JOIN;
+                break;
+            case 'D':
+                cf.hyphens = HYPHENS_MARK;
+                break;
+            case 'p':
+                pflag = 1;
+                break;
+            case 'c':
+                cflag = 1;
+                cvalue = optarg;
+                break;
+            case 'm':
+                mvalue = strtol(optarg, &end, 10);
+                if (*end || mvalue < 1) {
+                    fprintf(stderr, "%s: Invalid memory size %s.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                kflag = 1;
+                checkpoint_path = optarg;
+                break;
+            case 'n':
+                nvalue = strtoll(optarg, &end, 10);
+                if (*end || nvalue < 1) {
+                    fprintf(stderr, "%s: Invalid interval %s.\n", argv[0], optarg);
+                    exit(1);
+                }
+                checkpoint_interval = nvalue;
+                break;
+            case 'r':
+                rflag = 1;
+                break;
+            case 'F':
+                Fflag = 1;
+                break;
+            case 'f':
+                fflag = 1;
+                fvalue = optarg;
+                break;
+            case 'o':
+                oflag = 1;
+                ovalue = optarg;
+                break;
+            case 'x':
+                xflag = 1;
+                xvalue = optarg;
+                break;
+            case 'h':
+                usage(stdout);
+                exit(0);
+            default:
+                usage(stderr);
+                exit(1);
+            }
+    }
+
+    if (optind < argc) {
+        usage(stderr);
+        exit(1);
+    }
+
+    if (sflag) cf.smart_sigma = 1;
+
+    if (kflag && !(fflag && oflag)) {
+        fprintf(stderr, "%s: The -k option needs an input and an output file.\n", argv[0]);
+        exit(1);
+    }
+    if (rflag && !kflag) {
+        fprintf(stderr, "%s: The -r option needs a checkpoint file.\n", argv[0]);
+        exit(1);
+    }
+    if (kflag && (cflag || pflag)) {
+        fprintf(stderr, "%s: You can't use the -k option with -c or -p.\n", argv[0]);
+        exit(1);
+    }
+    if (Fflag && pflag) {
+        fprintf(stderr, "%s: You can't use the -F and -p options simultaneously.\n", argv[0]);
+        exit(1);
+    }
+
+    if (cflag) {
+        cf.index = cf.words = cf.count = 1;
+        index_open(mvalue << 20);
+    }
+    if (cf.case_mode != CASE_NONE || cf.hyphens) cf.words = 1;
+    cf.utf8 = cf.encoding == UTF8;
+    if (kflag) cf.count = 1;
+    if (Fflag) cf.follow = 1;
+
+    if (iflag && pflag) {
+        fprintf(stderr, "%s: You can't use the -i and -p options simultaneously.\n", argv[0]);
+        exit(1);
+    }
+
+    // Input from stdin, from a file, or from a string.
+    
+    in = stdin;
+
+    // Before any stream is open, make sure fflag and xflag are not set
+    // simultaneously.
+    if (fflag) {
+        if (xflag) {
+            fprintf(stderr, "%s: You can't use the -x and -f options simultaneously.\n", argv[0]);
+            exit(1);
+        }
+        in = fopen(fvalue, "r");
+        if (!in) {
+            fprintf(stderr, "Cannot read from file %s.\n", fvalue);
+            exit(1);
+        }
+    }
+
+    if (xflag) in = fmemopen(xvalue, strlen(xvalue), "r");
+
+    if (oflag) {
+        // When resuming, the output is kept up to the checkpoint.
+        out = fopen(ovalue, rflag ? "r+" : "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write to file %s.\n", ovalue);
+            exit(1);
+        }
+    } else {
+        out = stdout;
+    }
+
+    // Batch runs keep the default buffers.  In the interactive mode the input
+    // has to be unbuffered for input_ready to see what is pending.
+    if (iflag) {
+        cf.interactive = 1;
+        setvbuf(in, NULL, _IONBF, 0);
+    }
+
+    if (pflag && ftello(in) < 0) {
+        fprintf(stderr, "%s: The -p option needs a seekable input.\n", argv[0]);
+        exit(1);
+    }
+
+    if (pflag) {
+        profile_convert(cf, in, out, stderr);
+    } else {
+        if (rflag) {
+            checkpoint_read(in, out, cf);
+        } else if (kflag) {
+            next_checkpoint = checkpoint_interval;
+        }
+        checkpoint_out = out;
+        select_engine(cf)(in, out, cf);
     }
 
-    convert(in, out);
+    if (cflag) index_finish(cvalue);
 
-    if (xflag) putc('\n', out);
+    if (xflag) put_byte('\n', out, cf);
 
     fclose(in);
     fclose(out);
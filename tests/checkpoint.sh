@@ -0,0 +1,56 @@
+#!/bin/sh
+# Checks that a conversion interrupted, or run on an input which then grows,
+# and resumed with -r writes the same output as a conversion of the whole
+# input.  Usage: sh tests/checkpoint.sh [path/to/bcgreek]
+
+b=${1:-./bcgreek}
+t=$(mktemp -d) || exit 1
+trap 'rm -rf "$t"' EXIT
+fail=0
+
+# A sample with everything the end of the input can cut in half: modifiers,
+# capitals, sigmas, hyphens at the end of a line, CRLF and UTF-8 sequences.
+printf '*)/anqrwpos lo/gos e)sti\\ kai\\ w)=| *(/omhros kos-\nmos tis- \n' > "$t/in"
+printf 'kos-\r\nmo-\nnos s-\nse *s *)/a ss. sss caf\303\251 \360\237\230\200 ' >> "$t/in"
+printf '*1 r(/ a)/|| *(w=| end-' >> "$t/in"
+n=$(wc -c < "$t/in")
+
+# Append: convert every prefix, then the rest of the input after it grew.
+for o in "-s" "-s -C title" "-s -D -C upper" "-d -e utf-16le"; do
+    "$b" $o -f "$t/in" > "$t/full"
+    k=0
+    while [ $k -le $n ]; do
+        rm -f "$t/ck"
+        head -c $k "$t/in" > "$t/grow"
+        "$b" $o -k "$t/ck" -f "$t/grow" -o "$t/out"
+        cat "$t/in" > "$t/grow"
+        "$b" $o -k "$t/ck" -r -f "$t/grow" -o "$t/out"
+        if ! cmp -s "$t/out" "$t/full"; then
+            echo "FAIL: append after $k bytes with options $o"
+            fail=1
+        fi
+        k=$((k + 1))
+    done
+done
+
+# Kill: interrupt a run taking frequent checkpoints, resume it, then append.
+i=0
+while [ $i -lt 200 ]; do cat "$t/in"; i=$((i + 1)); done > "$t/big"
+"$b" -s -D -C title -f "$t/big" > "$t/full"
+head -c 20000 "$t/big" > "$t/grow"
+rm -f "$t/ck"
+"$b" -s -D -C title -k "$t/ck" -n 100 -f "$t/grow" -o "$t/out" &
+sleep 0.01
+kill -9 $! 2> /dev/null
+wait
+[ -f "$t/ck" ] || "$b" -s -D -C title -k "$t/ck" -f "$t/grow" -o "$t/out"
+"$b" -s -D -C title -k "$t/ck" -r -f "$t/grow" -o "$t/out"
+cat "$t/big" > "$t/grow"
+"$b" -s -D -C title -k "$t/ck" -r -f "$t/grow" -o "$t/out"
+if ! cmp -s "$t/out" "$t/full"; then
+    echo "FAIL: kill, resume and append"
+    fail=1
+fi
+
+[ $fail = 0 ] && echo "checkpoint: ok"
+exit $fail